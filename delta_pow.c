@@ -36,6 +36,17 @@ double get_dnudcdm_powerspec(_delta_pow *d_pow, double kk)
         return d_pow->norm * dnudcdm;
 }
 
+void get_dnudcdm_k2_table(_delta_pow *d_pow, const double kunit, const int nk2, double table[])
+{
+    int k2;
+    const double logkunit = log(kunit);
+    /*The mean density is not changed*/
+    table[0] = 1;
+    /*k increases monotonically, so the interpolation accelerator makes this cheap*/
+    for(k2 = 1; k2 < nk2; k2++)
+        table[k2] = 1 + get_dnudcdm_powerspec(d_pow, 0.5*log(k2)+logkunit);
+}
+
 void free_d_pow(_delta_pow * d_pow)
 {
   gsl_interp_free(d_pow->spline);
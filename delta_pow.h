@@ -38,6 +38,15 @@ void init_delta_pow(_delta_pow *d_pow, double logkk[], double delta_ratio[], int
  * */
 double get_dnudcdm_powerspec(_delta_pow *d_pow, double kk);
 
+/** Tabulate the factor multiplying the CDM density modes, 1 + get_dnudcdm_powerspec(log k),
+ * for every integer value of k^2 in units of the fundamental mode.
+ * On a grid every mode has integer k^2 = kx^2+ky^2+kz^2, so this needs only one interpolation per distinct |k|.
+ * @param d_pow (opaque) structure containing stored power spectrum and GSL interpolators.
+ * @param kunit Fundamental mode, 2 pi / BoxSize, in the units of d_pow->logkk.
+ * @param nk2 Size of table; one more than the largest k^2 needed.
+ * @param table Output: table[k2] = 1 + get_dnudcdm_powerspec(d_pow, log(sqrt(k2) kunit)). table[0] = 1.*/
+void get_dnudcdm_k2_table(_delta_pow *d_pow, const double kunit, const int nk2, double table[]);
+
 /** Free memory for the GSL structure*/
 void free_d_pow(_delta_pow * d_pow);
 #endif
@@ -42,6 +42,19 @@ static void test_get_dnudcdm_powerspec(void **state) {
     assert_true(fabs(get_dnudcdm_powerspec(d_pow, d_pow->logkk[d_pow->nbins-1]+0.01) - pklarge) < 5e-3*pklarge);
 }
 
+/*Check the table over integer k^2 matches direct interpolation*/
+static void test_get_dnudcdm_k2_table(void **state)
+{
+    _delta_pow * d_pow = (_delta_pow *) *state;
+    const int nk2 = 3*32*32+1;
+    const double kunit = exp(d_pow->logkk[0]);
+    double table[nk2];
+    get_dnudcdm_k2_table(d_pow, kunit, nk2, table);
+    assert_true(table[0] == 1);
+    for(int k2 = 1; k2 < nk2; k2++)
+        assert_true(fabs(table[k2] - 1 - get_dnudcdm_powerspec(d_pow, log(sqrt(k2)*kunit))) < 1e-12);
+}
+
 /*Test we can initialise a delta_pow structure from disc correctly.
  *Note if one of these assertions is false we won't actually get an error; just a message saying group setup failed.*/
 static int setup_delta_pow(void **state) {
@@ -126,6 +139,7 @@ int main(void) {
     const struct CMUnitTest tests[] = {
         cmocka_unit_test(test_init_delta_pow),
         cmocka_unit_test(test_get_dnudcdm_powerspec),
+        cmocka_unit_test(test_get_dnudcdm_k2_table),
     };
     return cmocka_run_group_tests(tests, setup_delta_pow, teardown_delta_pow);
 }
@@ -13,12 +13,68 @@
 #include <gsl/gsl_errno.h>
 #include <gsl/gsl_interp.h>
 #include <gsl/gsl_sf_bessel.h>
+#include <gsl/gsl_cblas.h>
 #include <unistd.h>
 #include <sys/stat.h>
 
 #include "delta_tot_table.h"
 #include "gadget_defines.h"
 #include "kspace_neutrino_const.h"
+#include "uniform_interp.h"
+
+/*Spacing in a between stored delta_tot with the fixed storage cadence*/
+#define DELTA_TOT_FIXED_DA 0.009
+/*Smallest and largest spacing in a between stored delta_tot with adaptive storage (store_tol > 0)*/
+#define DELTA_TOT_MIN_DA 0.003
+#define DELTA_TOT_MAX_DA 0.05
+/*Largest spacing in log a with adaptive storage: at early times the neutrino integral
+ * is dominated by the most recent e-fold, so rows must stay dense there regardless of the prediction.*/
+#define DELTA_TOT_MAX_DLOGA 0.1
+/*Number of stored delta_tot the table grows by when it is full*/
+#define DELTA_TOT_CHUNK 64
+/*Smallest and largest number of Chebyshev nodes in k used by get_delta_nu_lowrank. The rank is doubled until the error is small enough.*/
+#define LOWRANK_MIN 8
+#define LOWRANK_MAX 64
+/*Number of k bins at which get_delta_nu_lowrank checks its error against the exact weights*/
+#define LOWRANK_NCHECK 8
+/*Spacing of the first, coarse, set of k bins at which get_delta_nu_sampled computes delta_nu*/
+#define KSAMPLE_STRIDE 16
+/*get_delta_nu_sampled uses the free-streaming asymptote above this multiple of the free-streaming wavenumber*/
+#define KSAMPLE_KFS_FACTOR 10
+/*Number of newest stored delta_tot which compact_delta_tot never removes*/
+#define DELTA_TOT_COMPACT_KEEP 4
+/*Number of entries per unit log a in the free-streaming length table*/
+#define FSTAB_PER_LOGA 500
+
+/*Spacing and extent of the J(x) tables. Beyond SPECIALJ_XMAX we use the asymptotic expansion.*/
+#define SPECIALJ_DX 0.025
+#define SPECIALJ_XMAX 40
+/*Upper limit for integrals over the Fermi-Dirac distribution: e^-q is negligible beyond this.*/
+#define FERMI_DIRAC_QMAX 60
+
+/*Parameters of the fixed quadrature rule used for DELTA_NU_INT_MATRIX:
+ *Order of the Gauss-Legendre rule in each panel*/
+#define MATRIX_GL_ORDER 8
+/*Width in log a of the smallest panel, next to the current time*/
+#define MATRIX_MIN_PANEL 1e-4
+/*Ratio between the widths of successive panels, going back in time*/
+#define MATRIX_PANEL_GROWTH 1.4
+/*Largest allowed panel width in log a*/
+#define MATRIX_MAX_PANEL 0.05
+/*Number of k bins the fixed quadrature integrators evaluate together, in SIMD, at each quadrature node*/
+#define KVEC_BLOCK 64
+/*The k dimension of the SoA spline coefficients is padded to a multiple of this, so each row is 64-byte aligned*/
+#define KVEC_PAD 8
+/*Build the k block kernel for AVX-512, AVX2 and generic x86-64, and pick one at run time.
+ *Other compilers and architectures get a single version.*/
+#if defined(__GNUC__) && !defined(__clang__) && !defined(__INTEL_COMPILER) && defined(__x86_64__)
+#define KVEC_CLONES __attribute__((target_clones("avx512f","avx2","default")))
+#else
+#define KVEC_CLONES
+#endif
+/*Parameters of the quadrature rule used for DELTA_NU_INT_KNOTS, whose panels also have MATRIX_GL_ORDER nodes:
+ *Largest change in k times the free-streaming length across a panel, at the largest k*/
+#define KNOTS_MAX_DX 2
 
 /*Allocate memory for delta_tot_table. This is separate from delta_tot_init because we need to allocate memory
  * before we have the information needed to initialise it*/
@@ -33,21 +89,25 @@ void allocate_delta_tot_table(_delta_tot_table *d_tot, const int nk_in, const do
    /* Allocate memory for delta_tot here, so that we can have further memory allocated and freed
     * before delta_tot_init is called. The number nk here should be larger than the actual value needed.*/
    /*Allocate pointers to each k-vector*/
-   d_tot->namax=ceil(100*(TimeMax-TimeTransfer))+2;
+   d_tot->namax=0;
    d_tot->ia=0;
-   d_tot->delta_tot =(double **) mymalloc("kspace_delta_tot",nk_in*sizeof(double *));
-   /*Allocate list of scale factors, and space for delta_tot, in one operation.*/
-   d_tot->scalefact = (double *) mymalloc("kspace_scalefact",d_tot->namax*(nk_in+1)*sizeof(double));
-   /*Allocate actual data. Note that this means data can be accessed either as:
-    * delta_tot[k][a] OR as
-    * delta_tot[0][a+k*namax] */
-   d_tot->delta_tot[0] = d_tot->scalefact+d_tot->namax;
-   for(count=1; count< nk_in; count++)
-        d_tot->delta_tot[count] = d_tot->delta_tot[0] + count*d_tot->namax;
-   /*Allocate space for the initial neutrino power spectrum*/
-   d_tot->delta_nu_init =(double *) mymalloc("kspace_delta_nu_init",3*nk_in*sizeof(double));
+   d_tot->delta_tot =(delta_tot_real **) mymalloc("kspace_delta_tot",nk_in*sizeof(delta_tot_real *));
+   /*Space for the stored power spectra is allocated as they arrive*/
+   d_tot->scalefact = NULL;
+   delta_tot_table_reserve(d_tot, 1);
+   /*Allocate space for the initial neutrino power spectrum, the history computed by get_delta_nu_update_start, and the cost of each bin*/
+   d_tot->delta_nu_init =(double *) mymalloc("kspace_delta_nu_init",8*nk_in*sizeof(double));
    d_tot->delta_nu_last=d_tot->delta_nu_init+nk_in;
    d_tot->wavenum=d_tot->delta_nu_init+2*nk_in;
+   d_tot->history.delta_nu = d_tot->delta_nu_init+3*nk_in;
+   d_tot->history.tailcoef = d_tot->delta_nu_init+4*nk_in;
+   d_tot->kcost = d_tot->delta_nu_init+5*nk_in;
+   d_tot->kcost_step = d_tot->delta_nu_init+6*nk_in;
+   d_tot->delta_nu_prev = d_tot->delta_nu_init+7*nk_in;
+   d_tot->nu_nknown = 0;
+   for(count=0; count < nk_in; count++)
+       d_tot->kcost[count] = 1;
+   d_tot->history.pending = 0;
    /*Setup pointer to the matter density*/
    d_tot->omnu = omnu;
    /*Set the prefactor for delta_nu, and the units system*/
@@ -55,16 +115,102 @@ void allocate_delta_tot_table(_delta_tot_table *d_tot, const int nk_in, const do
    d_tot->delta_nu_prefac = 1.5 *Omega0 * HUBBLE * HUBBLE * pow(UnitTime_in_s,2)/d_tot->light;
    /*Matter fraction excluding neutrinos*/
    d_tot->Omeganonu = Omega0 - get_omega_nu(omnu, 1);
+   /*Allocate the free-streaming table. It is filled in as the simulation reaches each time,
+    * because we may not be able to call hubble_function yet.
+    * The table goes a little beyond TimeMax to allow for roundoff.*/
+   d_tot->fstab.loga0 = log(TimeTransfer);
+   d_tot->fstab.ntab = ceil(FSTAB_PER_LOGA*(log(TimeMax) - log(TimeTransfer)))+3;
+   d_tot->fstab.dloga = 1./FSTAB_PER_LOGA;
+   d_tot->fstab.nfilled = 0;
+   d_tot->fstab.cumul = (double *) mymalloc("kspace_fslength",2*d_tot->fstab.ntab*sizeof(double));
+   d_tot->fstab.deriv = d_tot->fstab.cumul + d_tot->fstab.ntab;
+   /*Tables of the free-streaming kernel. With hybrid neutrinos, each mass needs its own truncated table.
+    * qc is computed in the same way as in get_delta_nu, so that it will match.*/
+   specialJ_table_init(&d_tot->Jtab[0], 0);
+   d_tot->nJtab = 1;
+   if(omnu->hybnu.enabled) {
+       for(count=0; count < NUSPECIES; count++) {
+           const double qc = omnu->hybnu.vcrit * ((omnu->RhoNuTab[count] ? omnu->RhoNuTab[count]->mnu : 0)/omnu->kBtnu);
+           int j;
+           if(qc <= 0)
+               continue;
+           for(j=1; j < d_tot->nJtab; j++)
+               if(d_tot->Jtab[j].qc == qc)
+                   break;
+           if(j < d_tot->nJtab)
+               continue;
+           specialJ_table_init(&d_tot->Jtab[d_tot->nJtab], qc);
+           d_tot->nJtab++;
+       }
+   }
    /*Whether we save intermediate files and output diagnostics*/
    d_tot->debug = debug;
+   /*Store delta_tot at a fixed interval unless told otherwise*/
+   d_tot->store_tol = 0;
+   /*Keep every stored delta_tot unless told otherwise*/
+   d_tot->compact_tol = 0;
+   /*Compute the matrix integrator weights at every k unless told otherwise*/
+   d_tot->lowrank_tol = 0;
+   /*Evaluate the fixed quadratures for blocks of k bins unless told otherwise*/
+   d_tot->kvec = 1;
+   /*Integrate every k bin unless told otherwise*/
+   d_tot->ksample_tol = 0;
+   /*Integrate at every step unless told otherwise*/
+   d_tot->skip_tol = 0;
+   d_tot->nintegrated = 0;
+   d_tot->nskipped = 0;
+   /*Use the adaptive integrator unless told otherwise*/
+   d_tot->integrator = DELTA_NU_INT_QAG;
+   /*By default every rank computes every k bin*/
+   d_tot->NTask = 1;
+   d_tot->gather_delta_nu = NULL;
+   /*Use the host's hubble_function unless given a table*/
+   d_tot->background = NULL;
+}
+
+/* Make sure there is space for at least nrows stored times.
+ * The table grows by DELTA_TOT_CHUNK rows at a time, and the stored rows are copied over.
+ * scalefact and delta_tot stay in one block, with the k-major layout, so data can be accessed either as:
+ * delta_tot[k][a] OR as
+ * delta_tot[0][a+k*namax]
+ * This uses malloc rather than mymalloc, as gadget's mymalloc is a stack and cannot grow a block which is not on top.*/
+void delta_tot_table_reserve(_delta_tot_table * const d_tot, const int nrows)
+{
+    int ik;
+    if(nrows <= d_tot->namax)
+        return;
+    const int namax = DELTA_TOT_CHUNK*((nrows + DELTA_TOT_CHUNK - 1)/DELTA_TOT_CHUNK);
+    double * block = (double *) malloc(namax*(sizeof(double) + d_tot->nk_allocated*sizeof(delta_tot_real)));
+    if(!block)
+        terminate(2045,"Could not allocate space for %d stored power spectra\n", namax);
+    /*delta_tot follows scalefact*/
+    delta_tot_real * dblock = (delta_tot_real *) (block + namax);
+    if(d_tot->scalefact) {
+        memcpy(block, d_tot->scalefact, d_tot->namax*sizeof(double));
+        for(ik = 0; ik < d_tot->nk_allocated; ik++)
+            memcpy(dblock + ik*namax, d_tot->delta_tot[ik], d_tot->namax*sizeof(delta_tot_real));
+        free(d_tot->scalefact);
+    }
+    d_tot->scalefact = block;
+    for(ik = 0; ik < d_tot->nk_allocated; ik++)
+        d_tot->delta_tot[ik] = dblock + ik*namax;
+    d_tot->namax = namax;
 }
 
 /*Free memory for delta_tot_table.*/
 void free_delta_tot_table(_delta_tot_table *d_tot)
 {
+    /*Make sure the helper thread is not still using the table*/
+    if(d_tot->history.pending) {
+        pthread_join(d_tot->history.thread, NULL);
+        d_tot->history.pending = 0;
+    }
     myfree(d_tot->delta_tot);
-    myfree(d_tot->scalefact);
+    free(d_tot->scalefact);
     myfree(d_tot->delta_nu_init);
+    myfree(d_tot->fstab.cumul);
+    while(d_tot->nJtab > 0)
+        specialJ_table_free(&d_tot->Jtab[--d_tot->nJtab]);
 }
 
 void handler (const char * reason, const char * file, int line, int gsl_errno)
@@ -142,32 +288,273 @@ void delta_tot_init(_delta_tot_table * const d_tot, const int nk_in, const doubl
     if(d_tot->ThisTask==0 && d_tot->debug){
         save_all_nu_state(d_tot, NULL);
     }
+    fslength_table_extend(d_tot, exp(d_tot->scalefact[d_tot->ia-1]));
     /*Initialise delta_nu_last*/
     get_delta_nu_combined(d_tot, exp(d_tot->scalefact[d_tot->ia-1]), wavenum, d_tot->delta_nu_last);
+    d_tot->loga_nu_last = d_tot->scalefact[d_tot->ia-1];
+    d_tot->nu_nknown = 1;
     d_tot->delta_tot_init_done=1;
     return;
 }
 
-/*Function which wraps three get_delta_nu calls to get delta_nu three times,
- * so that the final value is for all neutrino species*/
-void get_delta_nu_combined(const _delta_tot_table * const d_tot, const double a, const double wavenum[],  double delta_nu_curr[])
+/*Get the range of k bins computed on this rank*/
+void get_delta_nu_krange(const int nk, const double kcost[], const int ThisTask, const int NTask, int * kstart, int * kend)
+{
+    double total = 0, cumul = 0;
+    int ik;
+    /*Not split: this also means we do not need ThisTask to be set.*/
+    if(NTask <= 1) {
+        *kstart = 0;
+        *kend = nk;
+        return;
+    }
+    if(kcost)
+        for(ik = 0; ik < nk; ik++)
+            total += kcost[ik];
+    if(total <= 0) {
+        *kstart = ((long) nk * ThisTask) / NTask;
+        *kend = ((long) nk * (ThisTask + 1)) / NTask;
+        return;
+    }
+    /*Each bin goes to the rank whose share of the total cost contains the middle of the bin.
+     * This is monotonic in k, so each rank gets a contiguous range. Every rank sums in the same order, so they agree.*/
+    *kstart = *kend = nk;
+    for(ik = 0; ik < nk; ik++) {
+        const int owner = NTask * (cumul + kcost[ik]/2) / total;
+        cumul += kcost[ik];
+        if(owner >= ThisTask && *kstart == nk)
+            *kstart = ik;
+        if(owner > ThisTask) {
+            *kend = ik;
+            break;
+        }
+    }
+    if(*kend < *kstart)
+        *kend = *kstart;
+}
+
+/*Integrates delta_nu for several neutrino species in a single pass; defined below get_delta_nu.*/
+static void get_delta_nu_species(const _delta_tot_table * const d_tot, const double a, const double scale[], const int Na, const double wavenum[], double delta_nu_curr[], double tailcoef[], double kcost_step[], const int nspecies, const double mnu[], const double weight[]);
+
+/* Compute the bins of delta_nu for this rank, summed over species, with Na stored times in scale.
+ * If tailcoef is not NULL, the last stored time is left out of delta_nu, and its coefficient stored in tailcoef.
+ * If kcost_step is not NULL, the cost of each bin integrated adaptively is stored in it.*/
+static void get_delta_nu_local(const _delta_tot_table * const d_tot, const double a, const double scale[], const int Na, const double wavenum[], double delta_nu_curr[], double tailcoef[], double kcost_step[])
 {
     const double Omega_nu_tot=get_omega_nu_nopart(d_tot->omnu, a);
-    int mi;
-    /*Initialise delta_nu_curr*/
-    memset(delta_nu_curr, 0, d_tot->nk*sizeof(double));
-    /*Get each neutrinos species and density separately and add them to the total.
+    int mi, nspecies = 0;
+    double mnu[NUSPECIES], weight[NUSPECIES];
+    /*Get each neutrinos species and density separately and add them to the total,
+     * weighted by density. All species are done in a single pass, as most of the work
+     * (free-streaming lengths, delta_tot splines, hubble function) does not depend on the mass.
      * Neglect perturbations in massless neutrinos.*/
     for(mi=0; mi<NUSPECIES; mi++) {
             if(d_tot->omnu->nu_degeneracies[mi] > 0) {
-                 int ik;
-                 double delta_nu_single[d_tot->nk];
                  const double omeganu = d_tot->omnu->nu_degeneracies[mi] * omega_nu_single(d_tot->omnu, a, mi);
-                 get_delta_nu(d_tot, a, wavenum, delta_nu_single,d_tot->omnu->RhoNuTab[mi]->mnu);
-                 for(ik=0; ik<d_tot->nk; ik++)
-                    delta_nu_curr[ik]+=delta_nu_single[ik]*omeganu/Omega_nu_tot;
+                 mnu[nspecies] = d_tot->omnu->RhoNuTab[mi]->mnu;
+                 weight[nspecies] = omeganu/Omega_nu_tot;
+                 nspecies++;
             }
     }
+    /*Bins on other ranks are filled in by the gather*/
+    memset(delta_nu_curr, 0, d_tot->nk*sizeof(double));
+    get_delta_nu_species(d_tot, a, scale, Na, wavenum, delta_nu_curr, tailcoef, kcost_step, nspecies, mnu, weight);
+}
+
+/* Compute delta_nu for the n k bins listed in kidx, with the bins split between ranks as usual.
+ * This uses a shallow copy of d_tot which holds only those bins, so all the integrators work unchanged.
+ * Every rank gets the results, which are stored in delta_nu_curr at the original bin.*/
+static void get_delta_nu_bins(const _delta_tot_table * const d_tot, const double a, const double wavenum[], double delta_nu_curr[], const int kidx[], const int n)
+{
+    _delta_tot_table sub = *d_tot;
+    int i;
+    if(n <= 0)
+        return;
+    /*Space for the rows of delta_tot, and the wavenumbers, initial conditions, costs and results of the subset*/
+    sub.delta_tot = (delta_tot_real **) malloc(n*sizeof(delta_tot_real *));
+    sub.wavenum = (double *) malloc(4*n*sizeof(double));
+    if(!sub.delta_tot || !sub.wavenum)
+        terminate(2016,"Error allocating memory for sampled k bins.\n");
+    sub.delta_nu_init = sub.wavenum + n;
+    sub.kcost = sub.wavenum + 2*n;
+    sub.kcost_step = NULL;
+    double * out = sub.wavenum + 3*n;
+    sub.nk = n;
+    for(i = 0; i < n; i++) {
+        sub.delta_tot[i] = d_tot->delta_tot[kidx[i]];
+        sub.wavenum[i] = wavenum[kidx[i]];
+        sub.delta_nu_init[i] = d_tot->delta_nu_init[kidx[i]];
+        sub.kcost[i] = 1;
+    }
+    get_delta_nu_local(&sub, a, sub.scalefact, sub.ia, sub.wavenum, out, NULL, NULL);
+    if(sub.NTask > 1)
+        sub.gather_delta_nu(out, n, sub.kcost, sub.NTask);
+    for(i = 0; i < n; i++)
+        delta_nu_curr[kidx[i]] = out[i];
+    free(sub.wavenum);
+    free(sub.delta_tot);
+}
+
+/* Ratio of delta_nu to the newest delta_tot in bin ik, which is smooth in k, up to the noise in the history of delta_tot.
+ * Returns 0 if delta_tot is not positive.*/
+static inline int sampled_ratio(const _delta_tot_table * const d_tot, const double delta_nu_curr[], const int ik, double * ratio)
+{
+    const double dtot = d_tot->delta_tot[ik][d_tot->ia-1];
+    if(dtot <= 0)
+        return 0;
+    *ratio = delta_nu_curr[ik]/dtot;
+    return 1;
+}
+
+/* Fill in the bins strictly between lo and hi, whose delta_nu is known, by interpolating the ratio to delta_tot as a power law in k.
+ * Returns the relative error of the interpolation at the bin mid, if it is known, or 0 otherwise. Returns a negative value
+ * if the ratio cannot be used. If fill is false, only the error is computed.*/
+static double sampled_interp(const _delta_tot_table * const d_tot, const double wavenum[], double delta_nu_curr[], const int lo, const int hi, const int mid, const int fill)
+{
+    double rlo, rhi, rmid = 1, err = 0;
+    int ik;
+    if(!sampled_ratio(d_tot, delta_nu_curr, lo, &rlo) || !sampled_ratio(d_tot, delta_nu_curr, hi, &rhi) || rlo <= 0 || rhi <= 0)
+        return -1;
+    for(ik = lo+1; ik < hi; ik++) {
+        const double frac = log(wavenum[ik]/wavenum[lo])/log(wavenum[hi]/wavenum[lo]);
+        const double interp = rlo * pow(rhi/rlo, frac);
+        if(d_tot->delta_tot[ik][d_tot->ia-1] <= 0)
+            return -1;
+        if(ik == mid) {
+            sampled_ratio(d_tot, delta_nu_curr, mid, &rmid);
+            err = fabs(interp/rmid - 1);
+        }
+        else if(fill)
+            delta_nu_curr[ik] = interp * d_tot->delta_tot[ik][d_tot->ia-1];
+    }
+    return err;
+}
+
+/* Compute delta_nu on every bin, but integrate only where it is needed, as described in get_delta_nu_combined.*/
+static void get_delta_nu_sampled(const _delta_tot_table * const d_tot, const double a, const double wavenum[], double delta_nu_curr[])
+{
+    const int nk = d_tot->nk;
+    /*Bins to compute, and intervals [lo, hi] still to check, with the bins between lo and hi not yet known.
+     * There are two lists of intervals, for those being checked and those to check next.*/
+    int * kidx = (int *) malloc(5*nk*sizeof(int));
+    int * lo = kidx + nk;
+    int * hi = kidx + 2*nk;
+    int * lonext = kidx + 3*nk;
+    int * hinext = kidx + 4*nk;
+    int nint = 0, n = 0, nexact = 0, top = nk-1, ik, mi;
+    double kfs = 0;
+    if(!kidx)
+        terminate(2016,"Error allocating memory for sampled k bins.\n");
+    /* Free-streaming wavenumber of the heaviest species, which is the largest.
+     * k_fs = sqrt(3/2 Omega_m(a)) a H(a) / v_th, with v_th = 3.15 T_nu / (a m_nu) the mean neutrino velocity,
+     * and 3/2 Omega_m(a) a^2 H(a)^2 = delta_nu_prefac * light / a.*/
+    for(mi = 0; mi < NUSPECIES; mi++)
+        if(d_tot->omnu->nu_degeneracies[mi] > 0) {
+            const double vth = 3.15 * d_tot->omnu->kBtnu / (a * d_tot->omnu->RhoNuTab[mi]->mnu);
+            kfs = fmax(kfs, sqrt(d_tot->delta_nu_prefac * d_tot->light / a) / (vth * d_tot->light));
+        }
+    /*Above KSAMPLE_KFS_FACTOR k_fs, delta_nu / delta_tot falls as k^-2. Find the first bin there.*/
+    if(kfs > 0)
+        for(ik = 0; ik < nk-2; ik++)
+            if(wavenum[ik] > KSAMPLE_KFS_FACTOR * kfs) {
+                top = ik;
+                break;
+            }
+    /*Coarse bins up to top, and the last bin, to check the asymptote*/
+    for(ik = 0; ik < top; ik += KSAMPLE_STRIDE)
+        kidx[n++] = ik;
+    kidx[n++] = top;
+    if(top < nk-1)
+        kidx[n++] = nk-1;
+    get_delta_nu_bins(d_tot, a, wavenum, delta_nu_curr, kidx, n);
+    nexact += n;
+    if(top < nk-1) {
+        double rtop, rlast;
+        /*If the asymptote is good enough at the last bin, use it for every bin above top*/
+        if(sampled_ratio(d_tot, delta_nu_curr, top, &rtop) && sampled_ratio(d_tot, delta_nu_curr, nk-1, &rlast)
+            && fabs(rtop * pow(wavenum[top]/wavenum[nk-1], 2)/rlast - 1) <= d_tot->ksample_tol) {
+            for(ik = top+1; ik < nk-1; ik++)
+                delta_nu_curr[ik] = rtop * pow(wavenum[top]/wavenum[ik], 2) * d_tot->delta_tot[ik][d_tot->ia-1];
+        }
+        /*Otherwise sample the bins above top like the others*/
+        else {
+            n = 0;
+            for(ik = top + KSAMPLE_STRIDE; ik < nk-1; ik += KSAMPLE_STRIDE)
+                kidx[n++] = ik;
+            get_delta_nu_bins(d_tot, a, wavenum, delta_nu_curr, kidx, n);
+            nexact += n;
+            lo[nint] = top;
+            hi[nint++] = (top + KSAMPLE_STRIDE < nk-1 ? top + KSAMPLE_STRIDE : nk-1);
+            for(ik = top + KSAMPLE_STRIDE; ik < nk-1; ik += KSAMPLE_STRIDE) {
+                lo[nint] = ik;
+                hi[nint++] = (ik + KSAMPLE_STRIDE < nk-1 ? ik + KSAMPLE_STRIDE : nk-1);
+            }
+        }
+    }
+    for(ik = 0; ik < top; ik += KSAMPLE_STRIDE) {
+        lo[nint] = ik;
+        hi[nint++] = (ik + KSAMPLE_STRIDE < top ? ik + KSAMPLE_STRIDE : top);
+    }
+    /* Check each interval by computing its middle bin, and comparing to the interpolation from its ends.
+     * If the interpolation is good enough, use it for the rest of the interval. Otherwise split the interval in two.*/
+    while(nint > 0) {
+        int i, nnew = 0;
+        int * tmp;
+        n = 0;
+        for(i = 0; i < nint; i++)
+            if(hi[i] - lo[i] > 1)
+                kidx[n++] = (lo[i] + hi[i])/2;
+        get_delta_nu_bins(d_tot, a, wavenum, delta_nu_curr, kidx, n);
+        nexact += n;
+        for(i = 0; i < nint; i++) {
+            const int l = lo[i], h = hi[i], mid = (l + h)/2;
+            if(h - l <= 1)
+                continue;
+            const double err = sampled_interp(d_tot, wavenum, delta_nu_curr, l, h, mid, 0);
+            if(err >= 0 && err <= d_tot->ksample_tol) {
+                sampled_interp(d_tot, wavenum, delta_nu_curr, l, mid, -1, 1);
+                sampled_interp(d_tot, wavenum, delta_nu_curr, mid, h, -1, 1);
+                continue;
+            }
+            lonext[nnew] = l;
+            hinext[nnew++] = mid;
+            lonext[nnew] = mid;
+            hinext[nnew++] = h;
+        }
+        tmp = lo;
+        lo = lonext;
+        lonext = tmp;
+        tmp = hi;
+        hi = hinext;
+        hinext = tmp;
+        nint = nnew;
+    }
+    if(d_tot->debug)
+        message(0,"Sampled delta_nu: integrated %d of %d k bins. k_fs = %g\n", nexact, nk, kfs);
+    free(kidx);
+}
+
+void get_delta_nu_combined(_delta_tot_table * const d_tot, const double a, const double wavenum[],  double delta_nu_curr[])
+{
+    if(d_tot->ksample_tol > 0) {
+        get_delta_nu_sampled(d_tot, a, wavenum, delta_nu_curr);
+        return;
+    }
+    /*Only the adaptive integrator measures the cost of each bin; the fixed quadratures cost the same everywhere.*/
+    const int measure = d_tot->integrator == DELTA_NU_INT_QAG;
+    /*Bins which are not integrated adaptively keep their old cost*/
+    if(measure)
+        memcpy(d_tot->kcost_step, d_tot->kcost, d_tot->nk*sizeof(double));
+    get_delta_nu_local(d_tot, a, d_tot->scalefact, d_tot->ia, wavenum, delta_nu_curr, NULL, measure ? d_tot->kcost_step : NULL);
+    /*Collect the bins computed on the other ranks, and their costs.
+     * Both are gathered with the split from the old costs, before these are replaced.*/
+    if(d_tot->NTask > 1) {
+        d_tot->gather_delta_nu(delta_nu_curr, d_tot->nk, d_tot->kcost, d_tot->NTask);
+        if(measure)
+            d_tot->gather_delta_nu(d_tot->kcost_step, d_tot->nk, d_tot->kcost, d_tot->NTask);
+    }
+    if(measure)
+        memcpy(d_tot->kcost, d_tot->kcost_step, d_tot->nk*sizeof(double));
     return;
 }
 
@@ -182,6 +569,7 @@ void update_delta_tot(_delta_tot_table * const d_tot, const double a, const doub
   int ik;
   if(!overwrite)
     d_tot->ia++;
+  delta_tot_table_reserve(d_tot, d_tot->ia);
   /*Update the scale factor*/
   d_tot->scalefact[d_tot->ia-1] = log(a);
   /* Update delta_tot(a)*/
@@ -190,9 +578,127 @@ void update_delta_tot(_delta_tot_table * const d_tot, const double a, const doub
   }
 }
 
+/* Body of the helper thread started by get_delta_nu_update_start.
+ * Computes delta_nu at history.a, as get_delta_nu_update would, with the new time appended to the stored ones,
+ * but leaving out the (not yet known) delta_tot at that time.*/
+static void * get_delta_nu_history(void * arg)
+{
+    _delta_tot_table * d_tot = (_delta_tot_table *) arg;
+    struct _delta_nu_history * hist = &d_tot->history;
+    const int Na = hist->ia+1;
+    /*This is not mymalloc, which is not thread-safe*/
+    double * scale = (double *) malloc(Na*sizeof(double));
+    if(!scale)
+        terminate(2016,"Error allocating memory for the delta_nu history.\n");
+    memcpy(scale, d_tot->scalefact, hist->ia*sizeof(double));
+    scale[Na-1] = log(hist->a);
+    fslength_table_extend(d_tot, hist->a);
+    get_delta_nu_local(d_tot, hist->a, scale, Na, d_tot->wavenum, hist->delta_nu, hist->tailcoef, NULL);
+    free(scale);
+    return NULL;
+}
+
+/* Extrapolate the last two integrated delta_nu to a, as a power law in a, if this changes delta_nu by less than skip_tol
+ * in every bin. The extrapolation is never taken further than the interval between the two.
+ * Returns 1 and stores the result in delta_nu_curr (if not NULL) if the extrapolation can be used, 0 otherwise.*/
+static int extrapolate_delta_nu(const _delta_tot_table * const d_tot, const double a, double delta_nu_curr[])
+{
+    int ik;
+    if(d_tot->skip_tol <= 0 || d_tot->nu_nknown < 2)
+        return 0;
+    const double frac = (log(a) - d_tot->loga_nu_last)/(d_tot->loga_nu_last - d_tot->loga_nu_prev);
+    if(frac < 0 || frac > 1)
+        return 0;
+    for(ik = 0; ik < d_tot->nk; ik++) {
+        const double d1 = d_tot->delta_nu_prev[ik];
+        const double d2 = d_tot->delta_nu_last[ik];
+        if(d1 <= 0 || d2 <= 0 || fabs(pow(d2/d1, frac) - 1) > d_tot->skip_tol)
+            return 0;
+    }
+    if(delta_nu_curr)
+        for(ik = 0; ik < d_tot->nk; ik++)
+            delta_nu_curr[ik] = d_tot->delta_nu_last[ik] * pow(d_tot->delta_nu_last[ik]/d_tot->delta_nu_prev[ik], frac);
+    return 1;
+}
+
+void get_delta_nu_update_start(_delta_tot_table * const d_tot, const double a)
+{
+    struct _delta_nu_history * hist = &d_tot->history;
+    if(hist->pending)
+        terminate(2041,"get_delta_nu_update_start called twice without get_delta_nu_update\n");
+    /*The adaptive integrator is not linear in the newest delta_tot*/
+    if(!d_tot->delta_tot_init_done || d_tot->integrator == DELTA_NU_INT_QAG)
+        return;
+    /*Nothing to do if the next step will not add a new time*/
+    if(log(a)-d_tot->scalefact[d_tot->ia-1] < FLOAT_ACC)
+        return;
+    /*Nor if the next step will extrapolate*/
+    if(extrapolate_delta_nu(d_tot, a, NULL))
+        return;
+    hist->a = a;
+    hist->ia = d_tot->ia;
+    hist->ThisTask = d_tot->ThisTask;
+    hist->NTask = d_tot->NTask;
+    if(pthread_create(&hist->thread, NULL, get_delta_nu_history, d_tot))
+        terminate(2042,"Could not start the delta_nu helper thread\n");
+    hist->pending = 1;
+}
+
+/* Wait for the helper thread started by get_delta_nu_update_start, if there is one.
+ * Returns 1 if its history can be used for a step at a with wavenumbers keff.*/
+static int join_delta_nu_history(_delta_tot_table * const d_tot, const double a, const double keff[])
+{
+    struct _delta_nu_history * hist = &d_tot->history;
+    int ik;
+    if(!hist->pending)
+        return 0;
+    pthread_join(hist->thread, NULL);
+    hist->pending = 0;
+    if(hist->a != a || hist->ia != d_tot->ia || hist->ThisTask != d_tot->ThisTask || hist->NTask != d_tot->NTask)
+        return 0;
+    for(ik = 0; ik < d_tot->nk; ik++)
+        if(keff[ik] != d_tot->wavenum[ik])
+            return 0;
+    return 1;
+}
+
+/* Decide whether to keep the newest (provisional) delta_tot, at a, in the table.
+ * With store_tol = 0 a row is kept every DELTA_TOT_FIXED_DA in a.
+ * Otherwise, each k of the new row is predicted by extrapolating the last two stored rows as a power law in a,
+ * which is exact for linear growth. The row is kept if the largest relative error of the prediction exceeds store_tol,
+ * so that rows are dense while the spectrum changes quickly, and sparse in the linear regime.
+ * Spacing is always kept between DELTA_TOT_MIN_DA and the smaller of DELTA_TOT_MAX_DA and DELTA_TOT_MAX_DLOGA in log a.*/
+static int store_delta_tot_row(const _delta_tot_table * const d_tot, const double a)
+{
+    const int inew = d_tot->ia-1;
+    const double da = a - exp(d_tot->scalefact[inew-1]);
+    double maxerr = 0;
+    int ik;
+    if(d_tot->store_tol <= 0)
+        return da >= DELTA_TOT_FIXED_DA;
+    if(da < DELTA_TOT_MIN_DA)
+        return 0;
+    if(da >= DELTA_TOT_MAX_DA || log(a) - d_tot->scalefact[inew-1] >= DELTA_TOT_MAX_DLOGA || inew < 2)
+        return 1;
+    const double frac = (d_tot->scalefact[inew] - d_tot->scalefact[inew-1])/(d_tot->scalefact[inew-1] - d_tot->scalefact[inew-2]);
+    for(ik = 0; ik < d_tot->nk; ik++) {
+        const double d1 = d_tot->delta_tot[ik][inew-2];
+        const double d2 = d_tot->delta_tot[ik][inew-1];
+        if(d1 <= 0 || d2 <= 0)
+            return 1;
+        const double pred = d2 * pow(d2/d1, frac);
+        maxerr = fmax(maxerr, fabs(d_tot->delta_tot[ik][inew]/pred - 1));
+    }
+    return maxerr > d_tot->store_tol;
+}
+
+static void compact_delta_tot(_delta_tot_table * const d_tot, const double a);
+
 void get_delta_nu_update(_delta_tot_table * const d_tot, const double a, const int nk_in, const double keff[], const double delta_cdm_curr[], double delta_nu_curr[], _transfer_init_table * transfer_init)
 {
   int ik;
+  /*The helper thread must be finished before anything in d_tot changes*/
+  const int have_history = join_delta_nu_history(d_tot, a, keff);
   /*Initialise delta_tot if we didn't already*/
   if(!d_tot->delta_tot_init_done) {
     delta_tot_init(d_tot, nk_in, keff, delta_cdm_curr, transfer_init, a);
@@ -211,6 +717,13 @@ void get_delta_nu_update(_delta_tot_table * const d_tot, const double a, const i
                delta_nu_curr[ik] = d_tot->delta_nu_last[ik];
        return;
   }
+  /*If delta_nu is changing slowly, as on a short PM step, extrapolate it rather than integrating*/
+  if(extrapolate_delta_nu(d_tot, a, delta_nu_curr)) {
+       d_tot->nskipped++;
+       if(d_tot->debug)
+           message(0,"Extrapolated delta_nu to a=%g: skipped %d of %d integrations\n", a, d_tot->nskipped, d_tot->nskipped + d_tot->nintegrated);
+       return;
+  }
 
    /*We need some estimate for delta_tot(current time) to obtain delta_nu(current time).
      Even though delta_tot(current time) is not directly used (the integrand vanishes at a = a(current)),
@@ -220,17 +733,36 @@ void get_delta_nu_update(_delta_tot_table * const d_tot, const double a, const i
      relative error on delta_nu to ~1E-4. So we only need one step. */
    /*This increments the number of stored spectra, although the last one is not yet final.*/
    update_delta_tot(d_tot, a, delta_cdm_curr, d_tot->delta_nu_last, 0);
+   fslength_table_extend(d_tot, a);
    /*Get the new delta_nu_curr*/
-   get_delta_nu_combined(d_tot, a, keff, delta_nu_curr);
-   /*Update delta_nu_last*/
+   if(have_history) {
+       /*Everything but the newest delta_tot was done by the helper thread.*/
+       int kstart, kend;
+       get_delta_nu_krange(d_tot->nk, d_tot->kcost, d_tot->ThisTask, d_tot->NTask, &kstart, &kend);
+       memset(delta_nu_curr, 0, d_tot->nk*sizeof(double));
+       for(ik = kstart; ik < kend; ik++)
+           delta_nu_curr[ik] = d_tot->history.delta_nu[ik] + d_tot->history.tailcoef[ik] * d_tot->delta_tot[ik][d_tot->ia-1];
+       if(d_tot->NTask > 1)
+           d_tot->gather_delta_nu(delta_nu_curr, d_tot->nk, d_tot->kcost, d_tot->NTask);
+   }
+   else
+       get_delta_nu_combined(d_tot, a, keff, delta_nu_curr);
+   /*Update delta_nu_last, keeping the one before for extrapolation*/
+   memcpy(d_tot->delta_nu_prev, d_tot->delta_nu_last, d_tot->nk*sizeof(double));
+   d_tot->loga_nu_prev = d_tot->loga_nu_last;
    for (ik = 0; ik < d_tot->nk; ik++)
        d_tot->delta_nu_last[ik]=delta_nu_curr[ik];
+   d_tot->loga_nu_last = log(a);
+   d_tot->nu_nknown = (d_tot->nu_nknown < 2 ? d_tot->nu_nknown + 1 : 2);
+   d_tot->nintegrated++;
    /* Decide whether we save the current time or not */
-   if (a >= exp(d_tot->scalefact[d_tot->ia-2]) + 0.009) {
+   if (store_delta_tot_row(d_tot, a)) {
        /* If so update delta_tot(a) correctly, overwriting current power spectrum */
        update_delta_tot(d_tot, a, delta_cdm_curr, delta_nu_curr, 1);
        if(d_tot->ThisTask==0 && d_tot->debug)
           save_delta_tot(d_tot, d_tot->ia-1, NULL);
+       /*Drop old power spectra which no longer matter*/
+       compact_delta_tot(d_tot, a);
    }
    /*Otherwise discard the last powerspectrum*/
    else
@@ -267,17 +799,19 @@ void read_all_nu_state(_delta_tot_table * const d_tot, char * savefile)
     }
     /*Read redshifts; Initial one is known already*/
     int iia;
-    for(iia=0; iia< d_tot->namax;iia++){
+    for(iia=0; ;iia++){
             double scale;
             int ik;
             if(fscanf(fd, "# %lg ", &scale) != 1)
                     break;
+            delta_tot_table_reserve(d_tot, iia+1);
             d_tot->scalefact[iia]=scale;
             /*Read kvalues*/
             /*If we do not have a complete delta_tot for one redshift, we stop
             * unless this is the first line, in which case we use it to set nk */
             for(ik=0;ik<d_tot->nk; ik++){
-                    if(fscanf(fd, "%lg ", &(d_tot->delta_tot[ik][iia])) != 1){
+                    double delta;
+                    if(fscanf(fd, "%lg ", &delta) != 1){
                         if(iia != 0){
                             terminate(2006,"Expected %d k values, got %d for delta_tot in %s; a=%g\n",d_tot->nk, ik, dfile, exp(d_tot->scalefact[iia]));
                         }
@@ -286,6 +820,7 @@ void read_all_nu_state(_delta_tot_table * const d_tot, char * savefile)
                             break;
                         }
                     }
+                    d_tot->delta_tot[ik][iia] = delta;
             }
     }
     /*If our table starts at a different time from the simulation, stop.*/
@@ -374,12 +909,20 @@ int save_nu_power(const _delta_tot_table * const d_tot, const double Time, const
 }
 /*What follows are private functions for the integration routine get_delta_nu*/
 
-/*Kernel function for the fslength integration*/
+/* The Hubble function, from the background table if there is one, or else from the host code.*/
+static inline double get_hubble(const _background_table * const bg, const double a)
+{
+    if(bg)
+        return background_hubble(bg, a);
+    return hubble_function(a);
+}
+
+/*Kernel function for the fslength integration. params is an optional background table.*/
 double fslength_int(const double loga, void *params)
 {
     /*This should be M_nu / k_B T_nu (which is dimensionless)*/
     const double a = exp(loga);
-    return 1./a/(a*hubble_function(a));
+    return 1./a/(a*get_hubble((const _background_table *) params, a));
 }
 
 /******************************************************************************************************
@@ -406,6 +949,44 @@ double fslength(const double logai, const double logaf, const double light)
   return light*fslength_val;
 }
 
+/*Compute the cumulative free-streaming table up to a*/
+void fslength_table_extend(_delta_tot_table * const d_tot, const double a)
+{
+    struct _fslength_table * fstab = &d_tot->fstab;
+    /*Interpolating at a needs the entries on both sides of it*/
+    const int nneeded = floor((log(a) - fstab->loga0)/fstab->dloga) + 2;
+    int i;
+    if(nneeded <= fstab->nfilled)
+        return;
+    if(nneeded > fstab->ntab)
+        terminate(2025,"Free-streaming table needed up to a=%g, but only allocated to a=%g\n",a, exp(fstab->loga0+(fstab->ntab-1)*fstab->dloga));
+    gsl_integration_workspace * w = gsl_integration_workspace_alloc (GSL_VAL);
+    gsl_function F;
+    F.function = &fslength_int;
+    F.params = (void *) d_tot->background;
+    if(fstab->nfilled == 0) {
+        fstab->cumul[0] = 0;
+        fstab->deriv[0] = fslength_int(fstab->loga0, (void *) d_tot->background);
+        fstab->nfilled = 1;
+    }
+    /*Each entry adds the integral over one interval to the previous one*/
+    for(i = fstab->nfilled; i < nneeded; i++) {
+        double abserr, fsl_int;
+        const double loga_i = fstab->loga0 + i*fstab->dloga;
+        gsl_integration_qag (&F, loga_i - fstab->dloga, loga_i, 0, 1e-10,GSL_VAL,6,w,&fsl_int, &abserr);
+        fstab->cumul[i] = fstab->cumul[i-1] + fsl_int;
+        fstab->deriv[i] = fslength_int(loga_i, (void *) d_tot->background);
+    }
+    fstab->nfilled = nneeded;
+    gsl_integration_workspace_free (w);
+}
+
+/*Look up the cumulative free-streaming integral at loga in the table*/
+static inline double fslength_table_eval(const struct _fslength_table * const fstab, const double loga)
+{
+    return uniform_hermite_eval(fstab->cumul, fstab->deriv, fstab->nfilled, fstab->loga0, fstab->dloga, loga);
+}
+
 /**************************************************************************************************
 Fit to the special function J(x) that is accurate to better than 3% relative and 0.07% absolute
     J(x) = Integrate[(Sin[q*x]/(q*x))*(q^2/(Exp[q] + 1)), {q, 0, Infinity}]
@@ -462,41 +1043,713 @@ double specialJ(const double x, const double qc, const double nufrac_low)
   return specialJ_fit(x);
 }
 
+/*Normalisation of the Fermi-Dirac distribution: integral_0^infty q^2/(e^q+1) dq = 3 zeta(3)/2*/
+#define FERMI_DIRAC_NORM (1.5 * 1.202056903159594)
+
+/*Integrands for J(x). We compute S(x) = int q/(e^q+1) sin(qx) dq,
+ * so that J = S/x and dJ/dx = S'/x - S/x^2, with S' = int q^2/(e^q+1) cos(qx) dq.*/
+static double fermi_dirac_q(double q, void * params)
+{
+    return q/(exp(q)+1);
+}
+
+static double fermi_dirac_q2(double q, void * params)
+{
+    return q*q/(exp(q)+1);
+}
+
+void specialJ_table_init(struct _specialJ_table * const Jtab, const double qc)
+{
+    int i;
+    double abserr;
+    gsl_function F;
+    gsl_integration_workspace * w = gsl_integration_workspace_alloc (GSL_VAL);
+    gsl_integration_qawo_table * wf = gsl_integration_qawo_table_alloc(1, FERMI_DIRAC_QMAX, GSL_INTEG_SINE, GSL_VAL);
+    Jtab->qc = qc;
+    Jtab->dx = SPECIALJ_DX;
+    Jtab->n = ceil(SPECIALJ_XMAX/SPECIALJ_DX)+1;
+    Jtab->J = (double *) mymalloc("specialJ_table", 2*Jtab->n*sizeof(double));
+    Jtab->dJ = Jtab->J + Jtab->n;
+    if(!w || !wf || !Jtab->J)
+        terminate(2016,"Error allocating memory for the J(x) table.\n");
+    F.params = NULL;
+    /*At x = 0, J is the integral of the distribution, and dJ/dx = 0*/
+    F.function = &fermi_dirac_q2;
+    gsl_integration_qag (&F, qc, FERMI_DIRAC_QMAX, 0, 1e-10, GSL_VAL, 6, w, &Jtab->J[0], &abserr);
+    Jtab->J[0] /= FERMI_DIRAC_NORM;
+    Jtab->dJ[0] = 0;
+    for(i = 1; i < Jtab->n; i++) {
+        const double x = i*Jtab->dx;
+        double sinint, cosint;
+        F.function = &fermi_dirac_q;
+        gsl_integration_qawo_table_set(wf, x, FERMI_DIRAC_QMAX - qc, GSL_INTEG_SINE);
+        gsl_integration_qawo(&F, qc, 1e-12, 1e-10, GSL_VAL, w, wf, &sinint, &abserr);
+        F.function = &fermi_dirac_q2;
+        gsl_integration_qawo_table_set(wf, x, FERMI_DIRAC_QMAX - qc, GSL_INTEG_COSINE);
+        gsl_integration_qawo(&F, qc, 1e-12, 1e-10, GSL_VAL, w, wf, &cosint, &abserr);
+        Jtab->J[i] = sinint/x/FERMI_DIRAC_NORM;
+        Jtab->dJ[i] = (cosint/x - sinint/x/x)/FERMI_DIRAC_NORM;
+    }
+    gsl_integration_qawo_table_free(wf);
+    gsl_integration_workspace_free (w);
+}
+
+void specialJ_table_free(struct _specialJ_table * const Jtab)
+{
+    myfree(Jtab->J);
+}
+
+/*Asymptotic expansion of J(x): for large x, J is set by the derivatives of q/(e^q+1) at q = 0.*/
+static inline double specialJ_asymptote(const double x)
+{
+    const double x2 = 1/(x*x);
+    return x2*x2*(0.5 + x2*(0.5 + 1.5*x2))/FERMI_DIRAC_NORM;
+}
+
+double specialJ_table_eval(const struct _specialJ_table * const Jtab, const double x, const double nufrac_low)
+{
+    if(x < (Jtab->n-1)*Jtab->dx) {
+        const double J = uniform_hermite_eval(Jtab->J, Jtab->dJ, Jtab->n, 0, Jtab->dx, x);
+        return (Jtab->qc > 0 ? J/(1 - nufrac_low) : J);
+    }
+    /*The truncated kernel oscillates at large x, so use the series*/
+    if(Jtab->qc > 0)
+        return Jfrac_high(x, Jtab->qc, nufrac_low);
+    return specialJ_asymptote(x);
+}
+
+/* Find the J(x) table for truncation momentum qc, or NULL if there is none.*/
+static const struct _specialJ_table * find_specialJ_table(const _delta_tot_table * const d_tot, const double qc)
+{
+    int j;
+    for(j = 0; j < d_tot->nJtab; j++)
+        if(fabs(d_tot->Jtab[j].qc - qc) <= 1e-12 * qc)
+            return &d_tot->Jtab[j];
+    return NULL;
+}
+
 /**A structure for the parameters for the below integration kernel*/
 struct _delta_nu_int_params
 {
     /**Current wavenumber*/
     double k;
-    /**Neutrino mass divided by k_B T_nu*/
-    double mnubykT;
+    /**Number of neutrino species integrated together*/
+    int nspecies;
+    /**Neutrino mass divided by k_B T_nu, for each species*/
+    const double * mnubykT;
+    /**Weight of each species in the sum*/
+    const double * weight;
+    /**Table of J(x) for each species*/
+    const struct _specialJ_table * const * Jtab;
     gsl_interp_accel *acc;
     gsl_interp *spline;
-    /**Precomputed free-streaming lengths*/
-    gsl_interp_accel *fs_acc;
-    gsl_interp *fs_spline;
-    double * fslengths;
-    double * fsscales;
-    /**Make sure this is at the same k as above*/
+    /**Precomputed cumulative free-streaming table*/
+    const struct _fslength_table * fstab;
+    /**Cumulative free-streaming integral at the current time*/
+    double fs_cumul_a;
+    /**Speed of light in internal units*/
+    double light;
+    /**Background table for H(a), or NULL to use hubble_function*/
+    const _background_table * background;
+    /**delta_tot in double precision. Make sure this is at the same k as above*/
     double * delta_tot;
-    double * scale;
-    /** qc is a dimensionless momentum (normalized to TNU): v_c * mnu / (k_B * T_nu).
+    const double * scale;
+    /** qc is a dimensionless momentum (normalized to TNU): v_c * mnu / (k_B * T_nu), for each species.
      * This is the critical momentum for hybrid neutrinos: it is unused if
      * hybrid neutrinos are not defined, but left here to save ifdefs.*/
-    double qc;
+    const double * qc;
     /*Fraction of neutrinos in particles for normalisation with hybrid neutrinos*/
     double nufrac_low;
 };
 typedef struct _delta_nu_int_params delta_nu_int_params;
 
+/* Free-streaming kernel, summed over the species with their weights.
+ * Only this depends on the neutrino mass, so everything else in the integrand is shared.*/
+static inline double species_specialJ(const double kfsl, const int nspecies, const double mnubykT[], const double weight[], const struct _specialJ_table * const Jtab[], const double qc[], const double nufrac_low)
+{
+    double specJ = 0;
+    int s;
+    for(s = 0; s < nspecies; s++) {
+        if(Jtab[s])
+            specJ += weight[s] * specialJ_table_eval(Jtab[s], kfsl/mnubykT[s], nufrac_low);
+        else
+            specJ += weight[s] * specialJ(kfsl/mnubykT[s], qc[s], nufrac_low);
+    }
+    return specJ;
+}
+
 /**GSL integration kernel for get_delta_nu*/
 double get_delta_nu_int(double logai, void * params)
 {
     delta_nu_int_params * p = (delta_nu_int_params *) params;
-    double fsl_aia = gsl_interp_eval(p->fs_spline,p->fsscales,p->fslengths,logai,p->fs_acc);
+    double fsl_aia = p->light * (p->fs_cumul_a - fslength_table_eval(p->fstab, logai));
     double delta_tot_at_a = gsl_interp_eval(p->spline,p->scale,p->delta_tot,logai,p->acc);
-    double specJ = specialJ(p->k*fsl_aia/p->mnubykT, p->qc, p->nufrac_low);
+    double specJ = species_specialJ(p->k*fsl_aia, p->nspecies, p->mnubykT, p->weight, p->Jtab, p->qc, p->nufrac_low);
     double ai = exp(logai);
-    return fsl_aia/(ai*hubble_function(ai)) * specJ * delta_tot_at_a;
+    return fsl_aia/(ai*get_hubble(p->background, ai)) * specJ * delta_tot_at_a;
+}
+
+/* Get the nodes and weights of the fixed quadrature rule used by get_delta_nu_matrix,
+ * between logaT and loga. The integrand is concentrated close to the current time at large k,
+ * so the rule is made of Gauss-Legendre panels which are smallest next to loga,
+ * and grow geometrically going back in time, up to a maximum width.
+ * Returns the number of nodes. nodes and weights must have space for nmax entries.*/
+static int get_matrix_quadrature(const double logaT, const double loga, double * nodes, double * weights, const int nmax)
+{
+    gsl_integration_glfixed_table * gltab = gsl_integration_glfixed_table_alloc(MATRIX_GL_ORDER);
+    double upper = loga, width = MATRIX_MIN_PANEL;
+    int nq = 0;
+    while(upper > logaT) {
+        const double lower = (upper - width > logaT ? upper - width : logaT);
+        int i;
+        if(nq + MATRIX_GL_ORDER > nmax)
+            terminate(2027,"Too many quadrature nodes: %d > %d\n", nq+MATRIX_GL_ORDER, nmax);
+        for(i = 0; i < MATRIX_GL_ORDER; i++)
+            gsl_integration_glfixed_point(lower, upper, i, &nodes[nq+i], &weights[nq+i], gltab);
+        nq += MATRIX_GL_ORDER;
+        upper = lower;
+        width *= MATRIX_PANEL_GROWTH;
+        if(width > MATRIX_MAX_PANEL)
+            width = MATRIX_MAX_PANEL;
+    }
+    gsl_integration_glfixed_table_free(gltab);
+    return nq;
+}
+
+/* Get the nodes and weights of the quadrature rule used by DELTA_NU_INT_KNOTS, between logaT and loga.
+ * delta_tot is a cubic spline between the stored times in scale, so each interval between them gets its own
+ * Gauss-Legendre panels, and no panel straddles a knot. An interval is split into equal panels in log a only where
+ * k times the free-streaming length changes by more than KNOTS_MAX_DX across it, at the largest k, kmax,
+ * so that the oscillation of J(x) is resolved, or where it is wider than MATRIX_MAX_PANEL.
+ * Beyond SPECIALJ_XMAX J(x) is small and smooth, so only the part of the interval below it counts.
+ * The rule depends only on the stored times and kmax, so the cost of a step is known in advance.
+ * Returns the number of nodes. If nodes is NULL, they are only counted.*/
+static int get_knot_quadrature(const _delta_tot_table * const d_tot, const double scale[], const int Na, const double loga, const double kmax, const double fs_cumul_a, double * nodes, double * weights, const int nmax)
+{
+    gsl_integration_glfixed_table * gltab = NULL;
+    double lower = log(d_tot->TimeTransfer);
+    int i = 0, nq = 0;
+    if(nodes)
+        gltab = gsl_integration_glfixed_table_alloc(MATRIX_GL_ORDER);
+    while(lower < loga) {
+        /*The next stored time, or the current time*/
+        while(i < Na && scale[i] <= lower + FLOAT_ACC)
+            i++;
+        const double upper = (i < Na && scale[i] < loga ? scale[i] : loga);
+        /*k x at each end of the interval, where x = c (fs(a) - fs(ai)) is the free-streaming length*/
+        const double xlower = fmin(kmax * d_tot->light * (fs_cumul_a - fslength_table_eval(&d_tot->fstab, lower)), SPECIALJ_XMAX);
+        const double xupper = fmin(kmax * d_tot->light * (fs_cumul_a - fslength_table_eval(&d_tot->fstab, upper)), SPECIALJ_XMAX);
+        int npanel = ceil(fmax((xlower - xupper)/KNOTS_MAX_DX, (upper - lower)/MATRIX_MAX_PANEL));
+        if(npanel < 1)
+            npanel = 1;
+        if(nodes) {
+            int p, j;
+            if(nq + npanel*MATRIX_GL_ORDER > nmax)
+                terminate(2027,"Too many quadrature nodes: %d > %d\n", nq+npanel*MATRIX_GL_ORDER, nmax);
+            for(p = 0; p < npanel; p++) {
+                const double width = (upper - lower)/npanel;
+                for(j = 0; j < MATRIX_GL_ORDER; j++)
+                    gsl_integration_glfixed_point(lower + p*width, lower + (p+1)*width, j, &nodes[nq+j], &weights[nq+j], gltab);
+                nq += MATRIX_GL_ORDER;
+            }
+        }
+        else
+            nq += npanel*MATRIX_GL_ORDER;
+        lower = upper;
+    }
+    if(gltab)
+        gsl_integration_glfixed_table_free(gltab);
+    return nq;
+}
+
+/* Maximum number of nodes get_matrix_quadrature can return between logaT and loga*/
+static int get_matrix_quadrature_max(const double logaT, const double loga)
+{
+    const int ngrow = ceil(log(MATRIX_MAX_PANEL/MATRIX_MIN_PANEL)/log(MATRIX_PANEL_GROWTH))+1;
+    return MATRIX_GL_ORDER*(ngrow + ceil((loga - logaT)/MATRIX_MAX_PANEL) + 1);
+}
+
+/* Row of the matrix W for wavenumber k: W[i] = sum_q K[q] B[q][i], where K[q] is the
+ * free-streaming kernel summed over species, times the weight of quadrature node q, and B the spline basis.
+ * kernel must have space for nq entries.*/
+static void get_matrix_weight_row(const double k, const int nq, const int Na, const double basis[], const double weights[], const double fsl[], const int nspecies, const double mnubykT[], const double weight[], const struct _specialJ_table * const Jtab[], const double qc[], const double nufrac_low, double kernel[], double wrow[])
+{
+    int j;
+    for(j = 0; j < nq; j++)
+        kernel[j] = weights[j] * species_specialJ(k*fsl[j], nspecies, mnubykT, weight, Jtab, qc, nufrac_low);
+    cblas_dgemv(CblasRowMajor, CblasTrans, nq, Na, 1., basis, Na, kernel, 1, 0., wrow, 1);
+}
+
+/* Barycentric weights for Lagrange interpolation through the r Chebyshev nodes in [-1,1] at x.
+ * Each of the r values of lag is the weight of the function at one node.*/
+static void chebyshev_lagrange(const double x, const int r, double lag[])
+{
+    double sum = 0;
+    int c;
+    for(c = 0; c < r; c++) {
+        const double node = cos(M_PI*(c+0.5)/r);
+        if(x == node) {
+            memset(lag, 0, r*sizeof(double));
+            lag[c] = 1;
+            return;
+        }
+        lag[c] = (c % 2 ? -1 : 1) * sin(M_PI*(c+0.5)/r)/(x - node);
+        sum += lag[c];
+    }
+    for(c = 0; c < r; c++)
+        lag[c] /= sum;
+}
+
+/* Low-rank version of the k loop of get_delta_nu_matrix. The weights W[k][i] are smooth in log k,
+ * so they are computed exactly only at r Chebyshev nodes in log k, between the smallest and largest k on this rank,
+ * and interpolated to every other k. This costs r*nq*Na rather than nk*nq*Na, and needs only r*nq kernel evaluations.
+ * The interpolated delta_nu is checked against the exact one at LOWRANK_NCHECK k bins. If the largest relative error
+ * exceeds lowrank_tol the rank is doubled, up to LOWRANK_MAX. Returns 1 if delta_nu_curr (and tailcoef) were filled in,
+ * and 0 if the error could not be met, in which case the caller should use the exact weights.*/
+static int get_delta_nu_lowrank(const _delta_tot_table * const d_tot, const int Na, const int Nsum, const int nq, const double basis[], const double weights[], const double fsl[], const double wavenum[], double delta_nu_curr[], double tailcoef[], const int nspecies, const double mnubykT[], const double weight[], const struct _specialJ_table * const Jtab[], const double qc[], const int kstart, const int kend)
+{
+    const double nufrac_low = d_tot->omnu->hybnu.nufrac_low[0];
+    double lkmin = log(wavenum[kstart]), lkmax = lkmin;
+    int ik, r;
+    for(ik = kstart; ik < kend; ik++) {
+        lkmin = fmin(lkmin, log(wavenum[ik]));
+        lkmax = fmax(lkmax, log(wavenum[ik]));
+    }
+    if(lkmax <= lkmin)
+        return 0;
+    for(r = LOWRANK_MIN; r <= LOWRANK_MAX && r < (kend - kstart)/2; r *= 2) {
+        double maxerr = 0;
+        /*Exact weights at each node. This may run on the helper thread, so use malloc.*/
+        double * wnode = malloc(r*Na*sizeof(double));
+        if(!wnode)
+            terminate(2016,"Error allocating memory for the quadrature matrix.\n");
+        #pragma omp parallel
+        {
+            double * kernel = (double *) malloc((nq+Na+r)*sizeof(double));
+            double * wrow = kernel + nq;
+            double * lag = wrow + Na;
+            if(!kernel)
+                terminate(2016,"Error allocating memory for the quadrature matrix.\n");
+            #pragma omp for
+            for(int c = 0; c < r; c++) {
+                const double lk = lkmin + (lkmax - lkmin)*(cos(M_PI*(c+0.5)/r)+1)/2;
+                get_matrix_weight_row(exp(lk), nq, Na, basis, weights, fsl, nspecies, mnubykT, weight, Jtab, qc, nufrac_low, kernel, wnode + c*Na);
+            }
+            /*Compare to the exact weights at a few k*/
+            #pragma omp for reduction(max: maxerr)
+            for(int ic = 0; ic < LOWRANK_NCHECK; ic++) {
+                const int kc = kstart + ((2*ic+1)*(kend - kstart))/(2*LOWRANK_NCHECK);
+                double exact = 0, approx = 0, norm = 0;
+                chebyshev_lagrange(2*(log(wavenum[kc]) - lkmin)/(lkmax - lkmin) - 1, r, lag);
+                get_matrix_weight_row(wavenum[kc], nq, Na, basis, weights, fsl, nspecies, mnubykT, weight, Jtab, qc, nufrac_low, kernel, wrow);
+                /*Only the first Nsum rows of delta_tot are known. If tailcoef is set, the newest row
+                 *is not yet stored, so weight the tail by the last known row, which it will be close to.*/
+                for(int i = 0; i < Na; i++) {
+                    const int irow = i < Nsum ? i : Nsum-1;
+                    double wi = 0;
+                    if(irow < 0)
+                        break;
+                    for(int c = 0; c < r; c++)
+                        wi += lag[c] * wnode[c*Na+i];
+                    exact += wrow[i] * d_tot->delta_tot[kc][irow];
+                    approx += wi * d_tot->delta_tot[kc][irow];
+                    norm += fabs(wrow[i] * d_tot->delta_tot[kc][irow]);
+                }
+                if(norm > 0)
+                    maxerr = fmax(maxerr, fabs(approx - exact)/norm);
+            }
+            if(maxerr <= d_tot->lowrank_tol) {
+                #pragma omp for
+                for(int ik = kstart; ik < kend; ik++) {
+                    double dsum = 0;
+                    chebyshev_lagrange(2*(log(wavenum[ik]) - lkmin)/(lkmax - lkmin) - 1, r, lag);
+                    for(int i = 0; i < Na; i++) {
+                        wrow[i] = 0;
+                        for(int c = 0; c < r; c++)
+                            wrow[i] += lag[c] * wnode[c*Na+i];
+                    }
+                    for(int i = 0; i < Nsum; i++)
+                        dsum += wrow[i] * d_tot->delta_tot[ik][i];
+                    delta_nu_curr[ik] += d_tot->delta_nu_prefac * dsum;
+                    if(tailcoef)
+                        tailcoef[ik] = d_tot->delta_nu_prefac * wrow[Na-1];
+                }
+            }
+            free(kernel);
+        }
+        free(wnode);
+        if(d_tot->debug)
+            message(0,"Low-rank delta_nu: rank %d error %g\n", r, maxerr);
+        if(maxerr <= d_tot->lowrank_tol)
+            return 1;
+    }
+    return 0;
+}
+
+/* Spline basis at the nq quadrature nodes, for the stored times ifirst to Na-1: entry j*(Na-ifirst) + i-ifirst is
+ * the spline through the unit vector at stored time i, evaluated at node j. Returns memory which should be freed by the caller.*/
+static double * get_spline_basis(const double scale[], const int Na, const int ifirst, const int nq, const double nodes[])
+{
+    const int ncol = Na - ifirst;
+    /*This may run on the helper thread of get_delta_nu_update_start, so use malloc rather than mymalloc*/
+    double * basis = malloc(nq*ncol*sizeof(double));
+    if(!basis)
+        terminate(2016,"Error allocating memory for the quadrature matrix.\n");
+    /*Interpolate each unit vector in turn*/
+    #pragma omp parallel
+    {
+        double * unit = (double *) calloc(Na, sizeof(double));
+        gsl_interp * spline = gsl_interp_alloc(Na > 2 ? gsl_interp_cspline : gsl_interp_linear,Na);
+        gsl_interp_accel * acc = gsl_interp_accel_alloc();
+        if(!unit || !spline || !acc)
+            terminate(2016,"Error initialising and allocating memory for gsl interpolator.\n");
+        #pragma omp for
+        for(int i = ifirst; i < Na; i++) {
+            unit[i] = 1;
+            gsl_interp_init(spline,scale,unit,Na);
+            gsl_interp_accel_reset(acc);
+            for(int j = 0; j < nq; j++)
+                basis[j*ncol+i-ifirst] = gsl_interp_eval(spline,scale,unit,nodes[j],acc);
+            unit[i] = 0;
+        }
+        gsl_interp_accel_free(acc);
+        gsl_interp_free(spline);
+        free(unit);
+    }
+    return basis;
+}
+
+/* Cubic spline of delta_tot in log a for a range of k bins, in structure-of-arrays layout:
+ * coefficient p of interval i for bin k of the range is coef[(4*i+p)*nkpad + k], so that k is innermost, contiguous and aligned.
+ * In interval i, delta_tot = c0 + t (c1 + t (c2 + t c3)), with t = loga - scale[i].*/
+struct _delta_tot_spline_soa {
+    /** Number of knots, and the knots in log a*/
+    int Na;
+    const double * scale;
+    /** Number of k bins, rounded up to a multiple of KVEC_PAD*/
+    int nkpad;
+    double * coef;
+};
+
+/* Build the natural cubic spline of delta_tot, as gsl_interp_cspline (or linear for two points), for the k bins kstart to kend.
+ * If zero_last is true, the newest delta_tot is taken to be zero. soa->coef should be freed by the caller.*/
+static void delta_tot_spline_soa_init(struct _delta_tot_spline_soa * const soa, const _delta_tot_table * const d_tot, const double scale[], const int Na, const int kstart, const int kend, const int zero_last)
+{
+    const int nk = kend - kstart;
+    const int nkpad = (nk + KVEC_PAD - 1)/KVEC_PAD*KVEC_PAD;
+    const int nint = Na - 1;
+    int i, k;
+    soa->Na = Na;
+    soa->nkpad = nkpad;
+    soa->scale = scale;
+    /*This may run on the helper thread of get_delta_nu_update_start, so use posix_memalign rather than mymalloc*/
+    if(posix_memalign((void **) &soa->coef, 64, 4*nint*nkpad*sizeof(double)) != 0)
+        terminate(2016,"Error allocating memory for the delta_tot spline.\n");
+    memset(soa->coef, 0, 4*nint*nkpad*sizeof(double));
+    double * y1 = malloc(nkpad*sizeof(double));
+    /*Forward elimination factors for the tridiagonal system, the same for every k*/
+    double * cp = malloc(2*Na*sizeof(double));
+    double * denom = cp + Na;
+    if(!y1 || !cp)
+        terminate(2016,"Error allocating memory for the delta_tot spline.\n");
+    /*Values, transposed so that k is innermost*/
+    for(i = 0; i < nint; i++) {
+        double * c0 = soa->coef + 4*i*nkpad;
+        for(k = 0; k < nk; k++)
+            c0[k] = d_tot->delta_tot[kstart+k][i];
+    }
+    if(zero_last)
+        memset(y1, 0, nkpad*sizeof(double));
+    else
+        for(k = 0; k < nk; k++)
+            y1[k] = d_tot->delta_tot[kstart+k][nint];
+    /*Second derivatives / 2, with c2 = 0 at both ends. Solve the tridiagonal system by the Thomas algorithm, k innermost.
+     *The right hand side is stored in c2 of each interval, and replaced by the solution.*/
+    for(i = 1; i < nint; i++) {
+        const double hlo = scale[i] - scale[i-1], hhi = scale[i+1] - scale[i];
+        const double * ylo = soa->coef + 4*(i-1)*nkpad;
+        const double * ymid = soa->coef + 4*i*nkpad;
+        const double * yhi = (i+1 < nint ? soa->coef + 4*(i+1)*nkpad : y1);
+        const double * rprev = soa->coef + (4*(i-1)+2)*nkpad;
+        double * r = soa->coef + (4*i+2)*nkpad;
+        denom[i] = 2*(hlo + hhi) - (i > 1 ? hlo*cp[i-1] : 0);
+        cp[i] = hhi/denom[i];
+        const double hr = (i > 1 ? hlo : 0);
+        #pragma omp simd
+        for(k = 0; k < nk; k++)
+            r[k] = (3*((yhi[k] - ymid[k])/hhi - (ymid[k] - ylo[k])/hlo) - hr*rprev[k])/denom[i];
+    }
+    for(i = nint-2; i >= 1; i--) {
+        double * c2 = soa->coef + (4*i+2)*nkpad;
+        const double * c2hi = soa->coef + (4*(i+1)+2)*nkpad;
+        #pragma omp simd
+        for(k = 0; k < nk; k++)
+            c2[k] -= cp[i]*c2hi[k];
+    }
+    /*First and third derivative coefficients, from the values and c2 at each end of the interval*/
+    for(i = 0; i < nint; i++) {
+        const double h = scale[i+1] - scale[i];
+        double * c = soa->coef + 4*i*nkpad;
+        const double * yhi = (i+1 < nint ? soa->coef + 4*(i+1)*nkpad : y1);
+        const double * c2hi = (i+1 < nint ? soa->coef + (4*(i+1)+2)*nkpad : NULL);
+        #pragma omp simd
+        for(k = 0; k < nk; k++) {
+            const double c2next = (c2hi ? c2hi[k] : 0);
+            c[nkpad+k] = (yhi[k] - c[k])/h - h*(c2next + 2*c[2*nkpad+k])/3;
+            c[3*nkpad+k] = (c2next - c[2*nkpad+k])/(3*h);
+        }
+    }
+    free(cp);
+    free(y1);
+}
+
+/* Interval of the spline containing loga. Points outside are extrapolated from the nearest interval.*/
+static int delta_tot_spline_soa_interval(const struct _delta_tot_spline_soa * const soa, const double loga)
+{
+    int lo = 0, hi = soa->Na-2;
+    while(lo < hi) {
+        const int mid = (lo + hi + 1)/2;
+        if(soa->scale[mid] <= loga)
+            lo = mid;
+        else
+            hi = mid - 1;
+    }
+    return lo;
+}
+
+/* Integrand of get_delta_nu for the nb k bins starting at kb (relative to the spline), summed over the quadrature nodes,
+ * as in get_matrix_weight_row, but with the delta_tot spline evaluated directly rather than through the basis matrix.
+ * At each node, the free-streaming kernel and the spline are evaluated for the whole block of k in SIMD.
+ * The kernel is the tabulated J(x), so every species must have a table.
+ * If tail is not NULL, tail gets the sum of the kernel times bnewest, the weight of the newest delta_tot at each node.*/
+KVEC_CLONES
+static void get_delta_nu_kblock(const struct _delta_tot_spline_soa * const soa, const int kb, const int nb, const double wavenum[], const int nq, const double nodes[], const double weights[], const double fsl[], const int interval[], const double bnewest[], const int nspecies, const double mnubykT[], const double weight[], const struct _specialJ_table * const Jtab[], const double nufrac_low, double sum[], double tail[])
+{
+    double kernel[KVEC_BLOCK];
+    int iq, s, k;
+    for(k = 0; k < nb; k++) {
+        sum[k] = 0;
+        if(tail)
+            tail[k] = 0;
+    }
+    for(iq = 0; iq < nq; iq++) {
+        const int i = interval[iq];
+        const double t = nodes[iq] - soa->scale[i];
+        const double * c0 = soa->coef + 4*i*soa->nkpad + kb;
+        const double * c1 = c0 + soa->nkpad;
+        const double * c2 = c0 + 2*soa->nkpad;
+        const double * c3 = c0 + 3*soa->nkpad;
+        #pragma omp simd
+        for(k = 0; k < nb; k++)
+            kernel[k] = 0;
+        for(s = 0; s < nspecies; s++) {
+            const struct _specialJ_table * const J = Jtab[s];
+            const double * const Jy = J->J;
+            const double * const Jdy = J->dJ;
+            const double dx = J->dx;
+            const int nlast = J->n-2;
+            const double xmax = (J->n-1)*dx;
+            const double scale = fsl[iq]/mnubykT[s];
+            const double norm = weight[s] * (J->qc > 0 ? 1/(1 - nufrac_low) : 1);
+            /*uniform_hermite_eval, written without branches so that it vectorises, with gathers from the table.
+             *Beyond the table, the asymptotic expansion, as in specialJ_table_eval. Truncated tables are fixed up below.*/
+            #pragma omp simd
+            for(k = 0; k < nb; k++) {
+                const double x = wavenum[k] * scale;
+                const double u = fmin(x/dx, nlast + 1);
+                const int ix = (int) u - ((int) u > nlast);
+                const double t1 = u - ix;
+                const double t2 = t1*t1;
+                const double t3 = t2*t1;
+                const double herm = (2*t3 - 3*t2 + 1)*Jy[ix] + (3*t2 - 2*t3)*Jy[ix+1] + dx*((t3 - 2*t2 + t1)*Jdy[ix] + (t3 - t2)*Jdy[ix+1]);
+                const double x2 = 1/(x*x);
+                const double asym = x2*x2*(0.5 + x2*(0.5 + 1.5*x2))/FERMI_DIRAC_NORM;
+                kernel[k] += norm * (x < xmax ? herm : asym);
+            }
+            /*The truncated kernel oscillates beyond the table, so needs the series, which does not vectorise*/
+            if(J->qc > 0)
+                for(k = 0; k < nb; k++)
+                    if(wavenum[k] * scale >= xmax)
+                        kernel[k] += weight[s] * Jfrac_high(wavenum[k] * scale, J->qc, nufrac_low) - norm * specialJ_asymptote(wavenum[k] * scale);
+        }
+        #pragma omp simd
+        for(k = 0; k < nb; k++) {
+            const double dtot = c0[k] + t*(c1[k] + t*(c2[k] + t*c3[k]));
+            sum[k] += weights[iq] * kernel[k] * dtot;
+        }
+        if(tail) {
+            #pragma omp simd
+            for(k = 0; k < nb; k++)
+                tail[k] += weights[iq] * kernel[k] * bnewest[iq];
+        }
+    }
+}
+
+/* The k loop of get_delta_nu_matrix, done with get_delta_nu_kblock for blocks of KVEC_BLOCK k bins, split between threads.
+ * If tailcoef is set, bnewest is the spline basis function of the newest delta_tot at each node.*/
+static void get_delta_nu_vector(const _delta_tot_table * const d_tot, const double scale[], const int Na, const int nq, const double nodes[], const double weights[], const double fsl[], const double bnewest[], const double wavenum[], double delta_nu_curr[], double tailcoef[], const int nspecies, const double mnubykT[], const double weight[], const struct _specialJ_table * const Jtab[], const int kstart, const int kend)
+{
+    struct _delta_tot_spline_soa soa;
+    const int nk = kend - kstart;
+    int iq;
+    /*The newest delta_tot is left to the caller if tailcoef is set*/
+    delta_tot_spline_soa_init(&soa, d_tot, scale, Na, kstart, kend, tailcoef != NULL);
+    int * interval = malloc(nq*sizeof(int));
+    if(!interval)
+        terminate(2016,"Error allocating memory for the quadrature nodes.\n");
+    for(iq = 0; iq < nq; iq++)
+        interval[iq] = delta_tot_spline_soa_interval(&soa, nodes[iq]);
+    #pragma omp parallel for schedule(dynamic)
+    for(int kb = 0; kb < nk; kb += KVEC_BLOCK) {
+        const int nb = (nk - kb < KVEC_BLOCK ? nk - kb : KVEC_BLOCK);
+        double sum[KVEC_BLOCK], tail[KVEC_BLOCK];
+        get_delta_nu_kblock(&soa, kb, nb, wavenum + kstart + kb, nq, nodes, weights, fsl, interval, bnewest, nspecies, mnubykT, weight, Jtab, d_tot->omnu->hybnu.nufrac_low[0], sum, tailcoef ? tail : NULL);
+        for(int k = 0; k < nb; k++) {
+            delta_nu_curr[kstart+kb+k] += d_tot->delta_nu_prefac * sum[k];
+            if(tailcoef)
+                tailcoef[kstart+kb+k] = d_tot->delta_nu_prefac * tail[k];
+        }
+    }
+    free(interval);
+    free(soa.coef);
+}
+
+/* Compute the history integral of get_delta_nu with a fixed quadrature rule, as a matrix product.
+ * The integrand is linear in delta_tot, and the spline interpolating delta_tot is a linear combination
+ * of the stored values. So for each k bin the integral is sum_i W[k][i] delta_tot[k][i], where
+ * W[k][i] = sum_q K[k][q] B[q][i], K[k][q] is the free-streaming kernel times the weight of quadrature node q,
+ * and B[q][i] is the spline basis function for stored time i evaluated at node q.
+ * The nodes, free-streaming lengths and hubble function are shared between all k, and B between all k.
+ * The kernel is summed over species, so each species adds only its special function evaluations.
+ * Note that the kernel depends on the current time through the free-streaming length, so W must be recomputed
+ * every time this is called.
+ * The result is added to delta_nu_curr for bins kstart to kend.*/
+static void get_delta_nu_matrix(const _delta_tot_table * const d_tot, const double a, const double scale[], const int Na, const double wavenum[], double delta_nu_curr[], double tailcoef[], const int nspecies, const double mnubykT[], const double weight[], const struct _specialJ_table * const Jtab[], const double qc[], const double fs_cumul_a, const int kstart, const int kend)
+{
+    const double logaT = log(d_tot->TimeTransfer);
+    /*Number of stored times summed here. The last is left to the caller if tailcoef is set.*/
+    const int Nsum = tailcoef ? Na-1 : Na;
+    int iq;
+    /*The knot-aligned rule is fine enough for the largest k on this rank*/
+    const int knots = (d_tot->integrator == DELTA_NU_INT_KNOTS);
+    double kmax = 0;
+    for(iq = kstart; iq < kend; iq++)
+        kmax = fmax(kmax, wavenum[iq]);
+    const int nqmax = knots ? get_knot_quadrature(d_tot, scale, Na, log(a), kmax, fs_cumul_a, NULL, NULL, 0) : get_matrix_quadrature_max(logaT, log(a));
+    /*This may run on the helper thread of get_delta_nu_update_start, so use malloc rather than mymalloc, which is not thread-safe*/
+    double * nodes = malloc(3*nqmax*sizeof(double));
+    if(!nodes)
+        terminate(2016,"Error allocating memory for the quadrature matrix.\n");
+    double * weights = nodes + nqmax;
+    double * fsl = nodes + 2*nqmax;
+    const int nq = knots ? get_knot_quadrature(d_tot, scale, Na, log(a), kmax, fs_cumul_a, nodes, weights, nqmax) : get_matrix_quadrature(logaT, log(a), nodes, weights, nqmax);
+    /*Spline basis, only needed by the low-rank and scalar paths*/
+    double * basis = NULL;
+    /*Scale-independent part of the kernel, folded into the weights.*/
+    #pragma omp parallel for
+    for(iq = 0; iq < nq; iq++) {
+        const double ai = exp(nodes[iq]);
+        fsl[iq] = d_tot->light * (fs_cumul_a - fslength_table_eval(&d_tot->fstab, nodes[iq]));
+        weights[iq] *= fsl[iq]/(ai*get_hubble(d_tot->background, ai));
+    }
+    /*Interpolate the weights in k if allowed, falling back to computing them for every k*/
+    if(d_tot->lowrank_tol > 0) {
+        basis = get_spline_basis(scale, Na, 0, nq, nodes);
+        if(get_delta_nu_lowrank(d_tot, Na, Nsum, nq, basis, weights, fsl, wavenum, delta_nu_curr, tailcoef, nspecies, mnubykT, weight, Jtab, qc, kstart, kend)) {
+            free(basis);
+            free(nodes);
+            return;
+        }
+    }
+    /*With a tabulated kernel for every species, evaluate the integrand for blocks of k together,
+     *with the delta_tot spline in SoA form rather than through the basis matrix.*/
+    for(iq = 0; iq < nspecies; iq++)
+        if(!Jtab[iq])
+            break;
+    if(d_tot->kvec && iq == nspecies && kend > kstart) {
+        /*The spline is evaluated directly, so only the basis function of the newest delta_tot is needed, for tailcoef*/
+        double * bnewest = tailcoef ? get_spline_basis(scale, Na, Na-1, nq, nodes) : NULL;
+        get_delta_nu_vector(d_tot, scale, Na, nq, nodes, weights, fsl, bnewest, wavenum, delta_nu_curr, tailcoef, nspecies, mnubykT, weight, Jtab, kstart, kend);
+        free(bnewest);
+        free(basis);
+        free(nodes);
+        return;
+    }
+    if(!basis)
+        basis = get_spline_basis(scale, Na, 0, nq, nodes);
+    #pragma omp parallel
+    {
+        double * kernel = (double *) malloc((nq+Na)*sizeof(double));
+        double * wrow = kernel + nq;
+        if(!kernel)
+            terminate(2016,"Error allocating memory for the quadrature matrix.\n");
+        #pragma omp for schedule(dynamic)
+        for(int ik = kstart; ik < kend; ik++) {
+            /*Row of W for this k: W[k][i] = sum_q K[k][q] B[q][i]*/
+            get_matrix_weight_row(wavenum[ik], nq, Na, basis, weights, fsl, nspecies, mnubykT, weight, Jtab, qc, d_tot->omnu->hybnu.nufrac_low[0], kernel, wrow);
+            /*delta_tot may be single precision, so sum it by hand, in double*/
+            double dsum = 0;
+            for(int i = 0; i < Nsum; i++)
+                dsum += wrow[i] * d_tot->delta_tot[ik][i];
+            delta_nu_curr[ik] += d_tot->delta_nu_prefac * dsum;
+            if(tailcoef)
+                tailcoef[ik] = d_tot->delta_nu_prefac * wrow[Na-1];
+        }
+        free(kernel);
+    }
+    free(basis);
+    free(nodes);
+}
+
+/* Remove old rows of delta_tot which no longer matter for delta_nu at a, so that the cost of get_delta_nu stops growing with time.
+ * Row i is removed if, for every k, the error in interpolating it from its neighbours as a power law in a,
+ * times its weight in the integral of get_delta_nu_int at a, is less than compact_tol times the last delta_nu.
+ * The weight uses J(x) for the heaviest species, which is the largest, and the width in log a the row covers.
+ * At large k old rows are damped by free-streaming, and at small k the history grows as a power law, which is interpolated exactly.
+ * No two neighbouring rows are removed in one call, and the first and the newest DELTA_TOT_COMPACT_KEEP rows are always kept.*/
+static void compact_delta_tot(_delta_tot_table * const d_tot, const double a)
+{
+    double mnubykT = 0;
+    int mi, i, ik, inew = 1, removed = 0;
+    if(d_tot->compact_tol <= 0)
+        return;
+    for(mi = 0; mi < NUSPECIES; mi++)
+        if(d_tot->omnu->nu_degeneracies[mi] > 0)
+            mnubykT = fmax(mnubykT, d_tot->omnu->RhoNuTab[mi]->mnu / d_tot->omnu->kBtnu);
+    /*Massless neutrinos have no integral piece*/
+    if(mnubykT <= 0)
+        return;
+    const double fs_cumul_a = fslength_table_eval(&d_tot->fstab, log(a));
+    /*Rows are moved down in place: inew is the next free slot, and inew-1 the last row kept.*/
+    for(i = 1; i < d_tot->ia; i++) {
+        int keep = removed || i >= d_tot->ia - DELTA_TOT_COMPACT_KEEP;
+        if(!keep) {
+            const double loga = d_tot->scalefact[i];
+            const double frac = (loga - d_tot->scalefact[inew-1])/(d_tot->scalefact[i+1] - d_tot->scalefact[inew-1]);
+            const double ai = exp(loga);
+            const double fsl = d_tot->light * (fs_cumul_a - fslength_table_eval(&d_tot->fstab, loga));
+            const double wt = d_tot->delta_nu_prefac * fsl/(ai*get_hubble(d_tot->background, ai)) * (d_tot->scalefact[i+1] - d_tot->scalefact[inew-1])/2.;
+            for(ik = 0; ik < d_tot->nk && !keep; ik++) {
+                const double d0 = d_tot->delta_tot[ik][inew-1];
+                const double d2 = d_tot->delta_tot[ik][i+1];
+                const double interp = (d0 > 0 && d2 > 0 ? d0 * pow(d2/d0, frac) : d0 + frac * (d2 - d0));
+                const double specJ = specialJ_table_eval(&d_tot->Jtab[0], d_tot->wavenum[ik]*fsl/mnubykT, d_tot->omnu->hybnu.nufrac_low[0]);
+                keep = wt * specJ * fabs(d_tot->delta_tot[ik][i] - interp) > d_tot->compact_tol * fabs(d_tot->delta_nu_last[ik]);
+            }
+        }
+        removed = !keep;
+        if(!keep)
+            continue;
+        if(inew < i) {
+            d_tot->scalefact[inew] = d_tot->scalefact[i];
+            for(ik = 0; ik < d_tot->nk; ik++)
+                d_tot->delta_tot[ik][inew] = d_tot->delta_tot[ik][i];
+        }
+        inew++;
+    }
+    if(d_tot->debug && inew < d_tot->ia)
+        message(0,"Compacted delta_tot at a=%g: %d -> %d stored\n", a, d_tot->ia, inew);
+    d_tot->ia = inew;
 }
 
 /*
@@ -505,24 +1758,65 @@ and initial conditions for neutrinos, computes the current delta_nu.
 Na is the number of currently stored time steps.
 */
 void get_delta_nu(const _delta_tot_table * const d_tot, const double a, const double wavenum[], double delta_nu_curr[],const double mnu)
+{
+  const double weight = 1;
+  get_delta_nu_species(d_tot, a, d_tot->scalefact, d_tot->ia, wavenum, delta_nu_curr, NULL, NULL, 1, &mnu, &weight);
+}
+
+/* A k bin and its cost, for ordering the bins most expensive first*/
+struct _kcost_order {
+    double cost;
+    int ik;
+};
+
+static int kcost_order_cmp(const void * a, const void * b)
+{
+    const struct _kcost_order * ka = (const struct _kcost_order *) a;
+    const struct _kcost_order * kb = (const struct _kcost_order *) b;
+    if(ka->cost != kb->cost)
+        return ka->cost < kb->cost ? 1 : -1;
+    return ka->ik - kb->ik;
+}
+
+/* Compute sum_s weight[s] delta_nu(mnu[s]), for nspecies neutrino species, in a single pass.
+ * The integrand is summed over species, so the delta_tot splines, free-streaming lengths and
+ * hubble function are evaluated once, and only the special function is evaluated per species.
+ * The integration error is relative to the total, which is what get_delta_nu_combined needs.
+ * delta_tot is interpolated from the Na times in scale. If tailcoef is not NULL, the term from the last of these is
+ * left out, and its coefficient stored in tailcoef: this needs DELTA_NU_INT_MATRIX or DELTA_NU_INT_KNOTS.
+ * If kcost_step is not NULL, the number of subintervals used by DELTA_NU_INT_QAG in each bin is stored in it.*/
+static void get_delta_nu_species(const _delta_tot_table * const d_tot, const double a, const double scale[], const int Na, const double wavenum[], double delta_nu_curr[], double tailcoef[], double kcost_step[], const int nspecies, const double mnu[], const double weight[])
 {
   double fsl_A0a,deriv_prefac;
-  int ik;
+  int ik, s, kstart, kend;
   /* Variable is unused unless we have hybrid neutrinos,
    * but we define it anyway to save ifdeffing later.*/
-  double qc = 0;
-  /*Number of stored power spectra. This includes the initial guess for the next step*/
-  const int Na = d_tot->ia;
-  const double mnubykT = mnu /d_tot->omnu->kBtnu;
+  double qc[NUSPECIES] = {0};
+  double mnubykT[NUSPECIES], massive_weight[NUSPECIES];
+  /*Tabulated J(x) for each massive species*/
+  const struct _specialJ_table * Jtab[NUSPECIES];
+  /*Number of massive species, which are the only ones with an integral piece*/
+  int nmassive = 0;
   /*Tolerated integration error*/
   double relerr = 1e-6;
   if(d_tot->debug)
-      message(0,"Start get_delta_nu: a=%g Na =%d wavenum[0]=%g delta_tot[0]=%g m_nu=%g\n",a,Na,wavenum[0],d_tot->delta_tot[0][Na-1],mnu);
+      message(0,"Start get_delta_nu: a=%g Na =%d wavenum[0]=%g delta_tot[0]=%g m_nu=%g species=%d\n",a,Na,wavenum[0],d_tot->delta_tot[0][d_tot->ia-1],mnu[0], nspecies);
+  /*Only compute the k bins assigned to this rank*/
+  get_delta_nu_krange(d_tot->nk, d_tot->kcost, d_tot->ThisTask, d_tot->NTask, &kstart, &kend);
+  if(tailcoef) {
+      if(d_tot->integrator == DELTA_NU_INT_QAG)
+          terminate(2043,"Only the fixed quadrature integrators can leave out the last delta_tot\n");
+      memset(tailcoef, 0, d_tot->nk*sizeof(double));
+  }
 
-  fsl_A0a = fslength(log(d_tot->TimeTransfer), log(a),d_tot->light);
+  /*Free-streaming lengths come from the cumulative table*/
+  if(log(a) > d_tot->fstab.loga0 + (d_tot->fstab.nfilled-1)*d_tot->fstab.dloga + FLOAT_ACC)
+      terminate(2026,"Free-streaming table only computed to a=%g, need a=%g\n",exp(d_tot->fstab.loga0 + (d_tot->fstab.nfilled-1)*d_tot->fstab.dloga),a);
+  const double fs_cumul_a = fslength_table_eval(&d_tot->fstab, log(a));
+  fsl_A0a = d_tot->light * fs_cumul_a;
   /*Precompute factor used to get delta_nu_init. This assumes that delta ~ a, so delta-dot is roughly 1.*/
-  deriv_prefac = d_tot->TimeTransfer*(hubble_function(d_tot->TimeTransfer)/d_tot->light)* d_tot->TimeTransfer;
-  for (ik = 0; ik < d_tot->nk; ik++) {
+  deriv_prefac = d_tot->TimeTransfer*(get_hubble(d_tot->background, d_tot->TimeTransfer)/d_tot->light)* d_tot->TimeTransfer;
+  for (ik = kstart; ik < kend; ik++) {
       /* Initial condition piece, assuming linear evolution of delta with a up to startup redshift */
       /* This assumes that delta ~ a, so delta-dot is roughly 1. */
       /* Also ignores any difference in the transfer functions between species.
@@ -530,9 +1824,21 @@ void get_delta_nu(const _delta_tot_table * const d_tot, const double a, const do
        * if two species are massless.
        * Also, since at early times the clustering is tiny, it is very unlikely to matter.*/
       /*For zero mass neutrinos just use the initial conditions piece, modulating to zero inside the horizon*/
-      const double specJ = specialJ(wavenum[ik]*fsl_A0a/(mnubykT > 0 ? mnubykT : 1),qc, d_tot->omnu->hybnu.nufrac_low[0]);
+      double specJ = 0;
+      for(s = 0; s < nspecies; s++) {
+          const double mnubykT_s = mnu[s] /d_tot->omnu->kBtnu;
+          specJ += weight[s] * specialJ_table_eval(&d_tot->Jtab[0], wavenum[ik]*fsl_A0a/(mnubykT_s > 0 ? mnubykT_s : 1), d_tot->omnu->hybnu.nufrac_low[0]);
+      }
       delta_nu_curr[ik] = specJ*d_tot->delta_nu_init[ik] *(1.+ deriv_prefac*fsl_A0a);
   }
+  /*If neutrino mass is zero, we are not accurate, just use the initial conditions piece*/
+  for(s = 0; s < nspecies; s++) {
+      if(mnu[s] > 0) {
+          mnubykT[nmassive] = mnu[s] /d_tot->omnu->kBtnu;
+          massive_weight[nmassive] = weight[s];
+          nmassive++;
+      }
+  }
   /* Check whether the particle neutrinos are active at this point.
    * If they are we want to truncate our integration.
    * Only do this is hybrid neutrinos are activated in the param file.*/
@@ -542,70 +1848,94 @@ void get_delta_nu(const _delta_tot_table * const d_tot, const double a, const do
       /*If the particles are everything, be done now*/
       if(1 - partnu < 1e-3)
           return;
-      qc = d_tot->omnu->hybnu.vcrit * mnubykT;
+      for(s = 0; s < nmassive; s++)
+          qc[s] = d_tot->omnu->hybnu.vcrit * mnubykT[s];
       /*More generous integration error for particle neutrinos*/
       relerr /= (1.+1e-5-particle_nu_fraction(&d_tot->omnu->hybnu,a,0));
   }
+  /*Use the tabulated kernel, if there is a table for this truncation*/
+  for(s = 0; s < nmassive; s++)
+      Jtab[s] = find_specialJ_table(d_tot, qc[s]);
   /*If only one time given, we are still at the initial time*/
-  /*If neutrino mass is zero, we are not accurate, just use the initial conditions piece*/
-  if(Na > 1 && mnubykT > 0){
-        delta_nu_int_params params;
-        params.acc = gsl_interp_accel_alloc();
-        gsl_integration_workspace * w = gsl_integration_workspace_alloc (GSL_VAL);
-        gsl_function F;
-        F.function = &get_delta_nu_int;
-        F.params=&params;
-        /*Use cubic interpolation*/
-        if(Na > 2) {
-                params.spline=gsl_interp_alloc(gsl_interp_cspline,Na);
-        }
-        /*Unless we have only two points*/
-        else {
-                params.spline=gsl_interp_alloc(gsl_interp_linear,Na);
+  if(Na > 1 && nmassive > 0 && d_tot->integrator != DELTA_NU_INT_QAG){
+        get_delta_nu_matrix(d_tot, a, scale, Na, wavenum, delta_nu_curr, tailcoef, nmassive, mnubykT, massive_weight, Jtab, qc, fs_cumul_a, kstart, kend);
+  }
+  else if(Na > 1 && nmassive > 0){
+        /* Each k bin is an independent integral, so split them between threads.
+         * Bins are handed out one at a time, most expensive first, by their cost at the last step,
+         * so that the threads finish together even when the number of subintervals varies a lot between bins.
+         * The free-streaming table is only read, but each thread needs its own
+         * integration workspace, delta_tot spline and interpolation accelerator.
+         * These are allocated with the GSL allocators, rather than mymalloc, which is not thread-safe.
+         * Each bin is computed in exactly the same way regardless of which thread does it,
+         * so the result is bitwise identical to the serial loop.
+         * Note this means that hubble_function must be safe to call from multiple threads,
+         * unless a background table is used.*/
+        struct _kcost_order * order = (struct _kcost_order *) malloc((kend - kstart)*sizeof(struct _kcost_order));
+        if(!order && kend > kstart)
+            terminate(2016,"Error allocating memory for the k bin order.\n");
+        for(ik = kstart; ik < kend; ik++) {
+            order[ik-kstart].cost = d_tot->kcost[ik];
+            order[ik-kstart].ik = ik;
         }
-        params.scale=d_tot->scalefact;
-        params.mnubykT=mnubykT;
-        params.qc = qc;
-        params.nufrac_low = d_tot->omnu->hybnu.nufrac_low[0];
-        /* Massively over-sample the free-streaming lengths.
-         * Interpolation is least accurate where the free-streaming length -> 0,
-         * which is exactly where it doesn't matter, but
-         * we still want to be safe. */
-        int Nfs = Na*16;
-        params.fs_acc = gsl_interp_accel_alloc();
-        params.fs_spline=gsl_interp_alloc(gsl_interp_cspline,Nfs);
-
-        /*Pre-compute the free-streaming lengths, which are scale-independent*/
-        double * fslengths = mymalloc("fslengths", Nfs* sizeof(double));
-        double * fsscales = mymalloc("fsscales", Nfs* sizeof(double));
-        for(ik=0; ik < Nfs; ik++) {
-            fsscales[ik] = log(d_tot->TimeTransfer) + ik*(log(a) - log(d_tot->TimeTransfer))/(Nfs-1.);
-            fslengths[ik] = fslength(fsscales[ik], log(a),d_tot->light);
+        qsort(order, kend - kstart, sizeof(struct _kcost_order), kcost_order_cmp);
+        #pragma omp parallel
+        {
+            delta_nu_int_params params;
+            params.acc = gsl_interp_accel_alloc();
+            gsl_integration_workspace * w = gsl_integration_workspace_alloc (GSL_VAL);
+            gsl_function F;
+            F.function = &get_delta_nu_int;
+            F.params=&params;
+            /*Use cubic interpolation*/
+            if(Na > 2) {
+                    params.spline=gsl_interp_alloc(gsl_interp_cspline,Na);
+            }
+            /*Unless we have only two points*/
+            else {
+                    params.spline=gsl_interp_alloc(gsl_interp_linear,Na);
+            }
+            params.scale=scale;
+            params.nspecies = nmassive;
+            params.mnubykT=mnubykT;
+            params.weight = massive_weight;
+            params.Jtab = Jtab;
+            params.qc = qc;
+            params.nufrac_low = d_tot->omnu->hybnu.nufrac_low[0];
+            params.fstab = &d_tot->fstab;
+            params.fs_cumul_a = fs_cumul_a;
+            params.light = d_tot->light;
+            params.background = d_tot->background;
+            /*The spline needs delta_tot in double precision, whatever it is stored as*/
+            params.delta_tot = (double *) malloc(Na*sizeof(double));
+
+            if(!params.spline || !params.acc || !w || !params.delta_tot)
+                  terminate(2016,"Error initialising and allocating memory for gsl interpolator and integrator.\n");
+
+            #pragma omp for schedule(dynamic)
+            for (int io = 0; io < kend - kstart; io++) {
+                const int ik = order[io].ik;
+                double abserr,d_nu_tmp;
+                params.k=wavenum[ik];
+                for(int i = 0; i < Na; i++)
+                    params.delta_tot[i] = d_tot->delta_tot[ik][i];
+                gsl_interp_init(params.spline,params.scale,params.delta_tot,Na);
+                gsl_integration_qag (&F, log(d_tot->TimeTransfer), log(a), 0, relerr,GSL_VAL,6,w,&d_nu_tmp, &abserr);
+                delta_nu_curr[ik] += d_tot->delta_nu_prefac * d_nu_tmp;
+                if(kcost_step)
+                    kcost_step[ik] = w->size;
+            }
+            free(params.delta_tot);
+            gsl_integration_workspace_free (w);
+            gsl_interp_free(params.spline);
+            gsl_interp_accel_free(params.acc);
         }
-        params.fslengths = fslengths;
-        params.fsscales = fsscales;
-
-        if(!params.spline || !params.acc || !w || !params.fs_spline || !params.fs_acc || !fslengths || !fsscales)
-              terminate(2016,"Error initialising and allocating memory for gsl interpolator and integrator.\n");
-
-        gsl_interp_init(params.fs_spline,params.fsscales,params.fslengths,Nfs);
-        for (ik = 0; ik < d_tot->nk; ik++) {
-            double abserr,d_nu_tmp;
-            params.k=wavenum[ik];
-            params.delta_tot=d_tot->delta_tot[ik];
-            gsl_interp_init(params.spline,params.scale,params.delta_tot,Na);
-            gsl_integration_qag (&F, log(d_tot->TimeTransfer), log(a), 0, relerr,GSL_VAL,6,w,&d_nu_tmp, &abserr);
-            delta_nu_curr[ik] += d_tot->delta_nu_prefac * d_nu_tmp;
-         }
-         gsl_integration_workspace_free (w);
-         gsl_interp_free(params.spline);
-         gsl_interp_accel_free(params.acc);
-         myfree(fsscales);
-         myfree(fslengths);
+        free(order);
    }
    if(d_tot->debug){
           for(ik=0; ik< 3; ik++)
-            message(0,"k %g d_nu %g\n",wavenum[d_tot->nk/8*ik], delta_nu_curr[d_tot->nk/8*ik]);
+            if(d_tot->nk/8*ik >= kstart && d_tot->nk/8*ik < kend)
+                message(1,"k %g d_nu %g\n",wavenum[d_tot->nk/8*ik], delta_nu_curr[d_tot->nk/8*ik]);
    }
    return;
 }
@@ -8,9 +8,90 @@
  * This file contains routines for manipulating this structure; updating it by computing a new neutrino power spectrum,
  * from the non-linear CDM power, and saving and loading the structure to and from disc.
  */
+#include <pthread.h>
 #include "transfer_init.h"
 #include "omega_nu_single.h"
 
+/** Cumulative table of the free-streaming integral, F(log a) = int_{log TimeTransfer}^{log a} dlog a' / (a'^2 H(a')),
+ * on a uniform grid in log a from TimeTransfer to TimeMax.
+ * The free-streaming length (times M_nu / k_B T_nu) between ai and a is then light * (F(a) - F(ai)).
+ * The integrand does not depend on neutrino mass or k, so this is shared by every call to get_delta_nu.
+ * Entries are computed only as the simulation reaches them, by fslength_table_extend.*/
+struct _fslength_table {
+    /** Number of entries allocated*/
+    int ntab;
+    /** Number of entries computed so far*/
+    int nfilled;
+    /** log of the scale factor of the first entry*/
+    double loga0;
+    /** Spacing of the table in log a*/
+    double dloga;
+    /** Cumulative free-streaming integral at each entry*/
+    double * cumul;
+    /** Integrand of the above (its derivative in log a) at each entry, for interpolation*/
+    double * deriv;
+};
+
+/** Table of the free-streaming kernel J(x) (see specialJ), computed by direct integration of
+ * the Fermi-Dirac distribution, on a uniform grid in x.
+ * If qc > 0, the distribution is truncated to momenta q > qc, as for hybrid neutrinos.
+ * Built by specialJ_table_init and evaluated by specialJ_table_eval.*/
+struct _specialJ_table {
+    /** Dimensionless momentum below which the distribution is truncated. Zero if not truncated.*/
+    double qc;
+    /** Number of entries*/
+    int n;
+    /** Spacing of the table in x. The table starts at x = 0.*/
+    double dx;
+    /** J(x) at each entry. For qc > 0 this is not divided by (1 - nufrac_low).*/
+    double * J;
+    /** Derivative dJ/dx at each entry, for interpolation*/
+    double * dJ;
+};
+
+/** Type in which the delta_tot history is stored. If DELTA_TOT_SINGLE is defined this is float,
+ * which halves the memory and broadcast volume of the history, and the cache it occupies in get_delta_nu.
+ * The power spectra it is computed from are noisy at the percent level, so this loses nothing.
+ * The integrals are always done in double precision.*/
+#ifdef DELTA_TOT_SINGLE
+typedef float delta_tot_real;
+#else
+typedef double delta_tot_real;
+#endif
+
+/** Methods for doing the time integral in get_delta_nu.
+ * Adaptive GSL quadrature, separately for each k bin. This is the default.*/
+#define DELTA_NU_INT_QAG 0
+/** A fixed quadrature rule, shared between all k bins. Since delta_nu is linear in delta_tot,
+ * the integral becomes a weighted sum over the stored delta_tot, with weights from the spline basis,
+ * free-streaming kernel and quadrature rule, evaluated with BLAS.*/
+#define DELTA_NU_INT_MATRIX 1
+/** As DELTA_NU_INT_MATRIX, but the quadrature rule has fixed-order Gauss-Legendre panels between the stored times,
+ * which are the knots of the delta_tot spline, and is subdivided only where the free-streaming kernel oscillates
+ * at the largest k. The cost of a step depends only on the stored times and the k range.*/
+#define DELTA_NU_INT_KNOTS 2
+
+/** The part of delta_nu at the next step which does not depend on the matter power at that step,
+ * computed on a helper thread by get_delta_nu_update_start, while the caller does other work.
+ * With DELTA_NU_INT_MATRIX or DELTA_NU_INT_KNOTS delta_nu is a fixed linear combination of the stored delta_tot,
+ * so only the coefficient of the newest delta_tot is needed to finish it.*/
+struct _delta_nu_history {
+    /** 1 if the helper thread has been started and not yet joined*/
+    int pending;
+    /** Scale factor of the step the history is for*/
+    double a;
+    /** Number of stored power spectra, and the split of k bins between ranks, when the history was started.*/
+    int ia;
+    int ThisTask;
+    int NTask;
+    /** For each k bin on this rank: delta_nu at a, excluding the term from delta_tot at a*/
+    double * delta_nu;
+    /** For each k bin on this rank: the coefficient of delta_tot at a in delta_nu*/
+    double * tailcoef;
+    /** Helper thread*/
+    pthread_t thread;
+};
+
 /** Now we want to define a static object to store all previous delta_tot.
  * This object needs a constructor, a few private data members, and a way to be read and written from disk.
  * nk is fixed, delta_tot, scalefact and ia are updated in get_delta_nu_update*/
@@ -19,7 +100,7 @@ struct _delta_tot_table {
     int nk;
     /** Size of arrays allocated to store power spectra*/
     int nk_allocated;
-    /** Maximum number of redshifts to store. Redshifts are stored every delta a = 0.01 */
+    /** Number of redshifts there is currently space for. This grows as needed, see delta_tot_table_reserve.*/
     int namax;
     /** Number of already "recorded" time steps, i.e. scalefact[0...ia-1] is recorded.
     * Current time corresponds to index ia (but is only recorded if sufficiently far from previous time).
@@ -27,14 +108,45 @@ struct _delta_tot_table {
     int ia;
     /** MPI rank of this processor*/
     int ThisTask;
+    /** Number of MPI ranks the k bins in get_delta_nu are split between.
+     * Each rank computes only the bins given by get_delta_nu_krange. Default is 1, so every rank computes every bin.*/
+    int NTask;
+    /** Function called by get_delta_nu_combined to collect the bins computed on every rank, if NTask > 1.
+     * On entry delta_nu_curr contains only the bins computed on this rank; on exit it should contain all nk bins.
+     * The bins are split as get_delta_nu_krange does with the costs kcost.
+     * This file does no communication, so this is set by the caller (see interface_common.c).*/
+    void (*gather_delta_nu)(double delta_nu_curr[], const int nk, const double kcost[], const int NTask);
     /** Prefactor for use in get_delta_nu. Should be 3/2 Omega_m H^2 /c */
     double delta_nu_prefac;
     /** Set to unity once the init routine has run.*/
     int delta_tot_init_done;
     /** If greater than 0, intermediate files will be saved and status output will be displayed*/
     int debug;
+    /** Method used for the time integral in get_delta_nu. One of the DELTA_NU_INT_* values above.*/
+    int integrator;
+    /** If zero, delta_tot is stored every 0.009 in a. If positive, a new delta_tot is stored only when
+     * extrapolating the stored ones predicts it worse than this relative error (see get_delta_nu_update).*/
+    double store_tol;
+    /** If positive, old delta_tot whose removal changes delta_nu by less than this relative error
+     * are dropped from the table after each new one is stored (see compact_delta_tot). If zero, all are kept.*/
+    double compact_tol;
+    /** If positive, DELTA_NU_INT_MATRIX and DELTA_NU_INT_KNOTS compute their weights exactly only at a few k, and interpolate them in k,
+     * as long as the estimated relative error in delta_nu is less than this. If zero, the weights are computed at every k.*/
+    double lowrank_tol;
+    /** If nonzero (the default), DELTA_NU_INT_MATRIX and DELTA_NU_INT_KNOTS evaluate the integrand for blocks of k bins together in SIMD,
+     * when every species has a J(x) table. If zero, the weights are computed one k bin at a time, as for untabulated kernels.*/
+    int kvec;
+    /** If positive, get_delta_nu_combined integrates only a subset of the k bins, and interpolates delta_nu / delta_tot
+     * in k for the others, refining until the interpolation is good to this relative error. If zero, every bin is integrated.*/
+    double ksample_tol;
+    /** If positive, get_delta_nu_update does not integrate at every call. When extrapolating the last two integrated delta_nu
+     * in log a changes delta_nu by less than this relative error, the extrapolation is used instead. If zero, every call integrates.*/
+    double skip_tol;
+    /** Number of calls to get_delta_nu_update which integrated, and which used the extrapolation instead*/
+    int nintegrated;
+    int nskipped;
     /** Pointer to nk arrays of length namax containing the total power spectrum.*/
-    double **delta_tot;
+    delta_tot_real **delta_tot;
     /** Array of length namax containing scale factors at which the power spectrum is stored*/
     double * scalefact;
     /** Pointer to array of length nk storing initial neutrino power spectrum*/
@@ -42,10 +154,25 @@ struct _delta_tot_table {
     /** Pointer to array of length nk storing the last neutrino power spectrum we saw, for a first estimate
     * of the new delta_tot */
     double * delta_nu_last;
+    /** Pointer to array of length nk storing the integrated delta_nu before delta_nu_last, for extrapolating with skip_tol*/
+    double * delta_nu_prev;
+    /** log(a) of delta_nu_last and delta_nu_prev, and how many of them are valid*/
+    double loga_nu_last;
+    double loga_nu_prev;
+    int nu_nknown;
     /**Pointer to array storing the effective wavenumbers for the above power spectra*/
     double * wavenum;
+    /** Cost of each k bin at the last adaptive integration: the number of subintervals it needed, for all species together.
+     * The k bins are split between ranks, and ordered for the threads, by this cost. All 1 until the first adaptive integration.*/
+    double * kcost;
+    /** Costs measured for the bins on this rank during the current get_delta_nu_combined, before they are gathered into kcost.
+     * Only filled in by DELTA_NU_INT_QAG.*/
+    double * kcost_step;
     /** Pointer to a structure for computing omega_nu*/
     const _omega_nu * omnu;
+    /** Precomputed background expansion. If not NULL, H(a) is looked up here instead of calling hubble_function.
+     * Must cover TimeTransfer to TimeMax for full speed; outside it H is computed directly.*/
+    const _background_table * background;
     /** Matter density excluding neutrinos*/
     double Omeganonu;
     /** Light speed in internal units. C is defined in allvars.h to be lightspeed in cm/s*/
@@ -54,6 +181,15 @@ struct _delta_tot_table {
      * NOTE! This is not All.TimeBegin, but the time of the transfer function file,
      * so that we can support restarting from snapshots.*/
     double TimeTransfer;
+    /** Table of free-streaming lengths, from TimeTransfer to TimeMax*/
+    struct _fslength_table fstab;
+    /** Number of J(x) tables in Jtab*/
+    int nJtab;
+    /** Tables of the free-streaming kernel J(x). The first is not truncated.
+     * If hybrid neutrinos are enabled there is also a truncated table for each neutrino mass.*/
+    struct _specialJ_table Jtab[NUSPECIES+1];
+    /** delta_nu history for the next step, if get_delta_nu_update_start was called*/
+    struct _delta_nu_history history;
 };
 typedef struct _delta_tot_table _delta_tot_table;
 
@@ -61,7 +197,7 @@ typedef struct _delta_tot_table _delta_tot_table;
  * @param d_tot structure to initialise
  * @param nk_in Number of bins stored in each power spectrum.
  * @param TimeTransfer Scale factor of the transfer functions.
- * @param TimeMax Final scale factor up to which we will need memory.
+ * @param TimeMax Final scale factor up to which the free-streaming table is needed.
  * @param Omega0 Matter density at z=0.
  * @param omnu Pointer to structure containing pre-computed tables for evaluating neutrino matter densities.
  * @param UnitTime_in_s Time unit of the simulation in s.
@@ -72,6 +208,13 @@ void allocate_delta_tot_table(_delta_tot_table *d_tot, const int nk_in, const do
 /** Frees the memory allocated above*/
 void free_delta_tot_table(_delta_tot_table *d_tot);
 
+/** Makes sure there is space for at least nrows stored power spectra, growing the table if needed.
+ * This moves delta_tot and scalefact, so pointers into them are invalid afterwards.
+ * Called when storing, reading or receiving power spectra: there is no need to call it otherwise.
+ * @param d_tot Structure allocated with allocate_delta_tot_table.
+ * @param nrows Number of stored times needed.*/
+void delta_tot_table_reserve(_delta_tot_table * const d_tot, const int nrows);
+
 /** Constructor. transfer_init_tabulate must be called before this function.
  * Initialises delta_tot (including from a file) and delta_nu_init from the transfer functions.
  * read_all_nu_state must be called before this if you want reloading from a snapshot to work
@@ -100,21 +243,54 @@ void update_delta_tot(_delta_tot_table * const d_tot, const double a, const doub
  * @param P_cdm_curr array of length nk containing the square root of the current cdm power spectrum
  * @param delta_nu_curr is an array of length nk which stores the square root of the current neutrino power spectrum. Main output of the function.
  * @param transfer_init is a pointer to the structure containing transfer tables.
+ * If d_tot->skip_tol > 0, delta_nu is extrapolated from the last two integrations when this changes it by less than skip_tol,
+ * so that short steps do not integrate. The number of skipped integrations is counted in d_tot->nskipped.
 ******************************************************************************************************/
 void get_delta_nu_update(_delta_tot_table * const d_tot, const double a, const int nk_in, const double keff[], const double P_cdm_curr[], double delta_nu_curr[], _transfer_init_table * transfer_init);
 
+/** Start computing delta_nu for the next step, a, on a helper thread, so that it can overlap other work,
+ * such as the short-range force. All of the integral except the term from the newest delta_tot is done here,
+ * which leaves almost nothing to do in get_delta_nu_update. This needs to know a, but not the matter power at a.
+ * It does nothing with the adaptive integrator, DELTA_NU_INT_QAG, which is not linear in delta_tot.
+ * The helper thread starts its own OpenMP team.
+ * Until the next get_delta_nu_update, d_tot must not be used by any other function.
+ * If the next get_delta_nu_update is not at a, the history is discarded and delta_nu computed as usual.
+ * @param d_tot contains the state of the integrator.
+ * @param a Scale factor of the next call to get_delta_nu_update.*/
+void get_delta_nu_update_start(_delta_tot_table * const d_tot, const double a);
+
 /** Main function: given tables of wavenumbers, total delta at Na earlier times (< = a),
  * and initial conditions for neutrinos, computes the current delta_nu.
  * @param d_tot Initialised structure for storing total matter density.
  * @param a Current scale factor.
  * @param wavenum Values of k (not log k!) for each power spectrum bin.
  * @param delta_nu_curr Pointer to array to store square root of neutrino power spectrum. Main output.
+ * Only the bins given by get_delta_nu_krange are set.
  * @param mnu Neutrino mass in eV.*/
 void get_delta_nu(const _delta_tot_table * const d_tot, const double a, const double wavenum[], double delta_nu_curr[], const double mnu);
 
-/** Function which wraps three get_delta_nu calls to get delta_nu three times,
- * so that the final value is for all neutrino species*/
-void get_delta_nu_combined(const _delta_tot_table * const d_tot, const double a, const double wavenum[],  double delta_nu_curr[]);
+/** Get the range of k bins, [kstart, kend), which get_delta_nu computes on rank ThisTask of NTask.
+ * Bins are split into contiguous chunks, in rank order, each with nearly equal total cost.
+ * @param nk Total number of k bins.
+ * @param kcost Cost of each bin, usually d_tot->kcost. If NULL, all bins cost the same.
+ * @param ThisTask Rank to compute the range for.
+ * @param NTask Number of ranks sharing the work.
+ * @param kstart First bin computed on this rank.
+ * @param kend One past the last bin computed on this rank.*/
+void get_delta_nu_krange(const int nk, const double kcost[], const int ThisTask, const int NTask, int * kstart, int * kend);
+
+/** Computes delta_nu for all neutrino species, weighted by their density, so that the final value is for all neutrino species.
+ * This is the same as summing get_delta_nu for each species, but the species are integrated together,
+ * so that the work which does not depend on the neutrino mass is done only once.
+ * If d_tot->NTask > 1 each rank computes only its share of the k bins, and
+ * the full delta_nu_curr is assembled with d_tot->gather_delta_nu.
+ * With DELTA_NU_INT_QAG the cost of each bin is measured and stored in d_tot->kcost, which sets the split at the next call.
+ * If d_tot->ksample_tol > 0 only some bins are integrated: first every 16th bin, and then the middle of each interval
+ * where interpolating delta_nu / delta_tot as a power law in k misses the middle bin by more than ksample_tol.
+ * The error is only checked at the middle bins, so bins where delta_tot is noisy may be off by more.
+ * Above ten times the neutrino free-streaming wavenumber, delta_nu / delta_tot falls as k^-2, and this is used instead,
+ * if it matches the integral at the last bin to ksample_tol.*/
+void get_delta_nu_combined(_delta_tot_table * const d_tot, const double a, const double wavenum[],  double delta_nu_curr[]);
 
 /** Save a single line in the delta_tot table to a file*/
 void save_delta_tot(const _delta_tot_table *const d_tot, const int iia, char * savedir);
@@ -137,6 +313,21 @@ void read_all_nu_state(_delta_tot_table * const d_tot, char * savedir);
 /** Fit to the special function J(x) that is accurate to better than 3% relative and 0.07% absolute*/
 double specialJ(const double x, const double vcmnubylight, const double nufrac_low);
 
+/** Compute a table of J(x) by numerical integration. Allocates memory.
+ * @param Jtab Table to initialise.
+ * @param qc Dimensionless momentum below which the Fermi-Dirac distribution is truncated, or zero.*/
+void specialJ_table_init(struct _specialJ_table * const Jtab, const double qc);
+
+/** Free memory for a J(x) table.*/
+void specialJ_table_free(struct _specialJ_table * const Jtab);
+
+/** Evaluate J(x), as specialJ, using a precomputed table.
+ * Beyond the end of the table it uses the large-x asymptotic expansion, or Jfrac_high if truncated.
+ * @param Jtab Table from specialJ_table_init.
+ * @param x Argument, k * free-streaming length / (m_nu / k_B T_nu).
+ * @param nufrac_low Fraction of neutrinos with q < qc, to normalise the truncated kernel.*/
+double specialJ_table_eval(const struct _specialJ_table * const Jtab, const double x, const double nufrac_low);
+
 /** Free-streaming length (times Mnu/k_BT_nu, which is dimensionless) for a non-relativistic
 particle of momentum q = T0, from scale factor ai to af.
 Arguments:
@@ -148,6 +339,12 @@ Arguments:
 */
 double fslength(const double logai, const double logaf, const double light);
 
+/** Compute the free-streaming table in d_tot up to (at least) scale factor a, if not already done.
+ * This is called by delta_tot_init and get_delta_nu_update, and must be called before get_delta_nu at a new time.
+ * @param d_tot Structure containing the table.
+ * @param a Scale factor up to which we need free-streaming lengths.*/
+void fslength_table_extend(_delta_tot_table * const d_tot, const double a);
+
 /** Combine the CDM and neutrino power spectra together to get the total power.
  * OmegaNua3 = OmegaNu(a) * a^3
  * Omeganonu = Omega0 - OmegaNu(1)
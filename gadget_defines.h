@@ -7,7 +7,7 @@
 
 #define  HUBBLE          3.24077929e-18	/* 100 km/s in h/sec */
 
-/*Forward define the hubble function*/
+/*Forward define the hubble function. This is called from within OpenMP parallel regions, so must be thread-safe.*/
 double hubble_function(double a);
 
 #include <stdlib.h>
@@ -21,6 +21,9 @@ static _transfer_init_table transfer_init;
 _delta_tot_table delta_tot_table;
 
 static _omega_nu omeganu_table;
+/*Tabulated background expansion, if InitBackground was called*/
+static _background_table background_table;
+static int background_table_on;
 /* We need this memory to persist - or rather,
  * we need it to be freed out-of-order. So make it global.*/
 double * delta_cdm_curr;
@@ -28,9 +31,18 @@ double * delta_cdm_curr;
 /*Compute the matter density in neutrinos*/
 double OmegaNu(double a)
 {
+    if(background_table_on)
+        return background_omega_nu(&background_table, a);
     return get_omega_nu(&omeganu_table, a);
 }
 
+double BackgroundHubble(double a)
+{
+    if(!background_table_on)
+        terminate(2040,"BackgroundHubble called before InitBackground\n");
+    return background_hubble(&background_table, a);
+}
+
 /* Compute the matter density in neutrinos, 
  * excluding density in particles.*/
 double OmegaNu_nopart(double a)
@@ -38,6 +50,11 @@ double OmegaNu_nopart(double a)
     return get_omega_nu_nopart(&omeganu_table, a);
 }
 
+void PrepareNeutrinoPower(const double Time_next)
+{
+    get_delta_nu_update_start(&delta_tot_table, Time_next);
+}
+
 void save_nu_state(char * savefile)
 {
     if(delta_tot_table.ThisTask == 0)
@@ -62,15 +79,21 @@ void broadcast_transfer_table(_transfer_init_table *t_init, int ThisTask, MPI_Co
   MPI_Bcast(t_init->logk,2*(t_init->NPowerTable),MPI_DOUBLE,0,MYMPI_COMM_WORLD);
 }
 
-void broadcast_delta_tot_table(_delta_tot_table *d_tot, const int nk_in, MPI_Comm MYMPI_COMM_WORLD)
+void broadcast_delta_tot_table(_delta_tot_table *d_tot, MPI_Comm MYMPI_COMM_WORLD)
 {
   /*Broadcast array sizes*/
   MPI_Bcast(&(d_tot->ia), 1,MPI_INT,0,MYMPI_COMM_WORLD);
   if(d_tot->ia > 0) {
+      MPI_Datatype rows;
       MPI_Bcast(&(d_tot->nk), 1,MPI_INT,0,MYMPI_COMM_WORLD);
-      /*Broadcast data for scalefact and delta_tot, Delta_tot is allocated as the same block of memory as scalefact.
-        Not all this memory will actually have been used, but it is easiest to bcast all of it.*/
-      MPI_Bcast(d_tot->scalefact,d_tot->namax*(nk_in+1),MPI_DOUBLE,0,MYMPI_COMM_WORLD);
+      delta_tot_table_reserve(d_tot, d_tot->ia);
+      /*Broadcast only the stored times. Each k is namax apart, and namax may differ between ranks,
+       * so describe the stored part of delta_tot with a strided type on each rank.*/
+      MPI_Bcast(d_tot->scalefact,d_tot->ia,MPI_DOUBLE,0,MYMPI_COMM_WORLD);
+      MPI_Type_vector(d_tot->nk, d_tot->ia, d_tot->namax, sizeof(delta_tot_real) == sizeof(float) ? MPI_FLOAT : MPI_DOUBLE, &rows);
+      MPI_Type_commit(&rows);
+      MPI_Bcast(d_tot->delta_tot[0],1,rows,0,MYMPI_COMM_WORLD);
+      MPI_Type_free(&rows);
   }
 }
 
@@ -89,19 +112,27 @@ void allocate_kspace_memory(const int nk_in, const int ThisTask, const double Bo
   /*Set the private copy of the task in delta_tot_table*/
   delta_tot_table.ThisTask = ThisTask;
   allocate_delta_tot_table(&delta_tot_table, nk_in, kspace_params.TimeTransfer, TimeMax, Omega0, &omeganu_table, UnitTime_in_s, UnitLength_in_cm, 0);
+  delta_tot_table.integrator = kspace_params.delta_nu_integrator;
+  delta_tot_table.store_tol = kspace_params.store_tol;
+  delta_tot_table.compact_tol = kspace_params.compact_tol;
+  delta_tot_table.lowrank_tol = kspace_params.lowrank_tol;
+  delta_tot_table.ksample_tol = kspace_params.ksample_tol;
+  delta_tot_table.skip_tol = kspace_params.skip_tol;
+  if(background_table_on)
+    delta_tot_table.background = &background_table;
   /*Read the saved data from a snapshot if present*/
   if(ThisTask==0 && snapdir != NULL) {
   	read_all_nu_state(&delta_tot_table, snapdir);
   }
   /*Broadcast save-data to other processors*/
-  broadcast_delta_tot_table(&delta_tot_table, nk_in, MYMPI_COMM_WORLD);
+  broadcast_delta_tot_table(&delta_tot_table, MYMPI_COMM_WORLD);
   /*Temporary float space so the power spectrum is not over-written before we are done with it*/
   delta_cdm_curr = mymalloc("temp_power_spectrum", 3*nk_in*sizeof(double));
   if(!delta_cdm_curr)
       terminate(2018,"Could not allocate temporary memory for power spectra\n");
 }
 
-_delta_pow compute_neutrino_power_internal(const double Time, double * keff, double * delta_cdm_curr, double * delta_nu_curr, const int nk_nonzero);
+_delta_pow compute_neutrino_power_internal(const double Time, double * keff, double * delta_cdm_curr, double * delta_nu_curr, const int nk_nonzero, MPI_Comm MYMPI_COMM_WORLD);
 
 _delta_pow compute_neutrino_power_from_cdm(const double Time, const double keff_in[], const double P_cdm[], const long int Nmodes[], const int nk_in, MPI_Comm MYMPI_COMM_WORLD)
 {
@@ -119,15 +150,42 @@ _delta_pow compute_neutrino_power_from_cdm(const double Time, const double keff_
       keff[nk_nonzero] = keff_in[i];
       nk_nonzero++;
   }
-  return compute_neutrino_power_internal(Time, keff, delta_cdm_curr,delta_nu_curr, nk_nonzero);
+  return compute_neutrino_power_internal(Time, keff, delta_cdm_curr,delta_nu_curr, nk_nonzero, MYMPI_COMM_WORLD);
 }
 
-_delta_pow compute_neutrino_power_internal(const double Time, double * keff, double * delta_cdm_curr, double * delta_nu_curr, const int nk_nonzero)
+/*Communicator the neutrino integrator is currently split over. Used by gather_delta_nu.*/
+static MPI_Comm delta_nu_comm;
+
+/* Collect the k bins of delta_nu computed on each rank, so that every rank has the full delta_nu.
+ * The bins are split as in get_delta_nu_krange.*/
+static void gather_delta_nu(double delta_nu_curr[], const int nk, const double kcost[], const int NTask)
 {
   int i;
+  int recvcounts[NTask];
+  int displs[NTask];
+  for(i=0; i<NTask; i++) {
+      int kstart, kend;
+      get_delta_nu_krange(nk, kcost, i, NTask, &kstart, &kend);
+      recvcounts[i] = kend - kstart;
+      displs[i] = kstart;
+  }
+  MPI_Allgatherv(MPI_IN_PLACE, 0, MPI_DATATYPE_NULL, delta_nu_curr, recvcounts, displs, MPI_DOUBLE, delta_nu_comm);
+}
+
+_delta_pow compute_neutrino_power_internal(const double Time, double * keff, double * delta_cdm_curr, double * delta_nu_curr, const int nk_nonzero, MPI_Comm MYMPI_COMM_WORLD)
+{
+  int i;
+  /* Every rank has the same data, so split the k bins of the integrator between ranks
+   * rather than computing each of them on every rank.*/
+  delta_nu_comm = MYMPI_COMM_WORLD;
+  MPI_Comm_rank(MYMPI_COMM_WORLD, &delta_tot_table.ThisTask);
+  MPI_Comm_size(MYMPI_COMM_WORLD, &delta_tot_table.NTask);
+  delta_tot_table.gather_delta_nu = gather_delta_nu;
   /*This sets up P_nu_curr.*/
   get_delta_nu_update(&delta_tot_table, Time, nk_nonzero, keff, delta_cdm_curr,  delta_nu_curr, &transfer_init);
   message(0,"Done getting neutrino power: nk= %d, k = %g, delta_nu = %g, delta_cdm = %g,\n",nk_nonzero, keff[1],delta_nu_curr[1],delta_cdm_curr[1]);
+  if(delta_tot_table.skip_tol > 0)
+      message(0,"Neutrino integrations skipped: %d of %d\n", delta_tot_table.nskipped, delta_tot_table.nskipped + delta_tot_table.nintegrated);
   /*Sets up the interpolation for get_neutrino_powerspec*/
   _delta_pow d_pow;
   /*We want to interpolate in log space*/
@@ -167,6 +225,7 @@ void set_nu_state(double * scalefact, double * delta_tot, const size_t nk, const
 {
     int i, ik;
     delta_tot_table.nk = nk;
+    delta_tot_table_reserve(&delta_tot_table, ia);
     delta_tot_table.ia = ia;
     for(i=0; i<ia; i++) {
         delta_tot_table.scalefact[i] = scalefact[i];
@@ -176,7 +235,7 @@ void set_nu_state(double * scalefact, double * delta_tot, const size_t nk, const
         for(i=0;i<ia;i++)
             delta_tot_table.delta_tot[ik][i] = delta_tot[ik*ia+i];
     /*Broadcast save-data to other processors*/
-    broadcast_delta_tot_table(&delta_tot_table, delta_tot_table.nk_allocated, MYMPI_COMM_WORLD);
+    broadcast_delta_tot_table(&delta_tot_table, MYMPI_COMM_WORLD);
 }
 
 /*Initialise only the omega_nu table.*/
@@ -187,6 +246,14 @@ void InitOmegaNu(const double HubbleParam, const double tcmb0, MPI_Comm MYMPI_CO
   init_omega_nu(&omeganu_table, kspace_params.MNu, kspace_params.TimeTransfer, HubbleParam, tcmb0);
 }
 
+void InitBackground(const double Omega0, const double OmegaLambda, const double Hubble, const int radiation, const double amin, const double amax)
+{
+  init_background_table(&background_table, &omeganu_table, Omega0, OmegaLambda, Hubble, radiation, amin, amax);
+  background_table_on = 1;
+  /*In case the integrator has already been allocated*/
+  delta_tot_table.background = &background_table;
+}
+
 int particle_nu_active(double a)
 {
     /*Return false if the active neutrino fraction is zero, true otherwise.*/
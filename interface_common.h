@@ -27,6 +27,20 @@ extern struct __kspace_params {
   double vcrit;
   /*Scale factor at which to turn on the particle neutrinos.*/
   double nu_crit_time;
+  /*Method for the time integral in get_delta_nu: one of the DELTA_NU_INT_* values in delta_tot_table.h*/
+  int delta_nu_integrator;
+  /*If true, multiply the grid by the neutrino power from the previous step, in the same pass which computes the power spectrum.*/
+  int lagged_ratio;
+  /*Relative error for adaptive storage of delta_tot. If zero, delta_tot is stored at fixed intervals. See _delta_tot_table.store_tol*/
+  double store_tol;
+  /*Relative error for dropping old delta_tot from the history. If zero, every stored delta_tot is kept. See _delta_tot_table.compact_tol*/
+  double compact_tol;
+  /*Relative error for interpolating the matrix integrator weights in k. If zero, they are computed at every k. See _delta_tot_table.lowrank_tol*/
+  double lowrank_tol;
+  /*Relative error for interpolating delta_nu between integrated k bins. If zero, every bin is integrated. See _delta_tot_table.ksample_tol*/
+  double ksample_tol;
+  /*Relative change in delta_nu below which it is extrapolated rather than integrated. If zero, every step integrates. See _delta_tot_table.skip_tol*/
+  double skip_tol;
 } kspace_params;
 
 /** Return the total matter density in all neutrino species.
@@ -45,6 +59,22 @@ double OmegaNu_nopart(double a);
 
 void InitOmegaNu(const double HubbleParam, const double tcmb0, MPI_Comm MYMPI_COMM_WORLD);
 
+/** Optional: precompute the background expansion, H(a) and OmegaNu(a), on a dense grid.
+ * Afterwards OmegaNu and BackgroundHubble are O(1) table lookups, and the integrator uses the table
+ * instead of calling hubble_function. Call after InitOmegaNu, on all ranks.
+ * The tabulated H(a) is that of the Gadget-2 patch: if your hubble_function differs (eg, dark energy), do not call this.
+ * @param Omega0 total matter density today, including massive neutrinos.
+ * @param OmegaLambda cosmological constant density.
+ * @param Hubble Hubble constant in internal units.
+ * @param radiation If true, include photons in H(a).
+ * @param amin, amax Range of scale factors to tabulate. Outside this, values are computed directly.*/
+void InitBackground(const double Omega0, const double OmegaLambda, const double Hubble, const int radiation, const double amin, const double amax);
+
+/** The Hubble function from the table set up by InitBackground.
+ * Suitable for use as hubble_function, and when computing drift and kick factors.
+ * @param a scale factor. */
+double BackgroundHubble(double a);
+
 /** This function allocates memory for the neutrino tables, and loads the initial transfer
  * functions from CAMB transfer files.
  * One processor 0 it reads the transfer tables from CAMB into the transfer_init structure.
@@ -75,10 +105,20 @@ void allocate_kspace_memory(const int nk_in, const int ThisTask,const double Box
  * @param keff_in k values for each power bin. Has units of UnitLength_in_cm passed to transfer_init
  * @param P_cdm Normalised matter power spectrum. Has units of UnitLength_in_cm passed to transfer_init
  * @param Nmodes number of modes in each bin. Used only to see if bin is nonempty.
- * @param MYMPI_COMM_WORLD MPI communicator to use
+ * @param MYMPI_COMM_WORLD MPI communicator to use. The k bins of the integrator are split between its ranks,
+ * so this must be called collectively.
  * @returns _delta_pow, containing delta_nu/delta_cdm*/
 _delta_pow compute_neutrino_power_from_cdm(const double Time, const double keff_in[], const double P_cdm[], const long int Nmodes[], const int nk_in, MPI_Comm MYMPI_COMM_WORLD);
 
+/** Optional: start computing the neutrino power for the next PM step, at scale factor Time_next, on a helper thread.
+ * Call this once the next PM time is known, for example just before the short-range (tree) force,
+ * so that the integrator runs while the tree walk does. The next call to add_nu_power_to_rhogrid
+ * (or compute_neutrino_power_from_cdm) then only adds the term from the new matter power.
+ * Only has an effect with KspaceIntegrator = 1 or 2; if the next step is not at Time_next, the work is discarded.
+ * The helper thread uses its own OpenMP threads, so you may want to run the tree with one fewer.
+ * @param Time_next scale factor of the next PM step.*/
+void PrepareNeutrinoPower(const double Time_next);
+
 /** Save the internal state of the integrator to disc.
  * @param savedir Output file is savedir/delta_tot_nu.txt.
  * Each row of the output file contains a scale factor and
@@ -3,6 +3,7 @@
  * All MPI communication is also done here.
  * add_nu_power_to_rhogrid is the main public function. */
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <math.h>
 #include "interface_gadget.h"
@@ -20,6 +21,10 @@ double * delta_cdm_last;
 
 _delta_pow d_pow;
 
+/*Neutrino factor for each k^2 from the previous step, used if kspace_params.lagged_ratio is set.*/
+static double * lagged_k2_table;
+static int lagged_nk2;
+
 /*Setup the config files to load the needed variables.
  * This is an example config file reader specific to P-Gadget3.*/
 int set_kspace_vars(char tag[][50], void *addr[], int id [], int nt)
@@ -54,11 +59,32 @@ int set_kspace_vars(char tag[][50], void *addr[], int id [], int nt)
       strcpy(tag[nt], "NuPartTime");
       addr[nt] = &(kspace_params.nu_crit_time);
       id[nt++] = REAL;
+      strcpy(tag[nt], "KspaceIntegrator");
+      addr[nt] = &(kspace_params.delta_nu_integrator);
+      id[nt++] = INT;
+      strcpy(tag[nt], "KspaceStorageTolerance");
+      addr[nt] = &(kspace_params.store_tol);
+      id[nt++] = REAL;
+      strcpy(tag[nt], "KspaceHistoryTolerance");
+      addr[nt] = &(kspace_params.compact_tol);
+      id[nt++] = REAL;
+      strcpy(tag[nt], "KspaceLowRankTolerance");
+      addr[nt] = &(kspace_params.lowrank_tol);
+      id[nt++] = REAL;
+      strcpy(tag[nt], "KspaceKSampleTolerance");
+      addr[nt] = &(kspace_params.ksample_tol);
+      id[nt++] = REAL;
+      strcpy(tag[nt], "KspaceSkipTolerance");
+      addr[nt] = &(kspace_params.skip_tol);
+      id[nt++] = REAL;
+      strcpy(tag[nt], "KspaceLaggedRatio");
+      addr[nt] = &(kspace_params.lagged_ratio);
+      id[nt++] = INT;
       return nt;
 }
 
 /*See interface_common.c*/
-_delta_pow compute_neutrino_power_internal(const double Time, double * keff, double * delta_cdm_curr, double * delta_nu_curr, const int nk_nonzero);
+_delta_pow compute_neutrino_power_internal(const double Time, double * keff, double * delta_cdm_curr, double * delta_nu_curr, const int nk_nonzero, MPI_Comm MYMPI_COMM_WORLD);
 
 /* This function calculates the matter power spectrum, then calls the integrator to compute the neutrino power spectrum,
  * which is stored in _delta_pow and returned.
@@ -66,13 +92,12 @@ _delta_pow compute_neutrino_power_internal(const double Time, double * keff, dou
  * Time - scale factor, a.
  * BoxSize - size of the box in internal units.
  * fft_of_rhogrid - Fourier transformed density grid.
- * pmgrid - size of one dimension of the density grid.
- * slabstart_y - for slab parallelized FFT routines, this is the start index of the FFT on this rank.
- * nslab_y - number of elements of the FFT on this rank.
+ * layout - which part of the grid is on this rank, and how it is stored.
+ * table - if not NULL, each mode of the grid is multiplied by table[k^2] in the same pass as the power spectrum is computed.
  * MYMPI_COMM_WORLD - MPI communicator to use
  * Global state used: delta_tot_table, transfer_init, omeganu_table
  * Returns: _delta_pow, containing delta_nu/delta_cdm*/
-_delta_pow compute_neutrino_power_spectrum(const double Time, const double BoxSize, fftw_complex *fft_of_rhogrid, const int pmgrid, int slabstart_y, int nslab_y, MPI_Comm MYMPI_COMM_WORLD)
+_delta_pow compute_neutrino_power_spectrum(const double Time, const double BoxSize, fftw_complex *fft_of_rhogrid, const _kspace_layout * layout, const double * table, MPI_Comm MYMPI_COMM_WORLD)
 {
   int i, nk_in;
   const int nk_allocated = delta_tot_table.nk_allocated;
@@ -89,7 +114,9 @@ _delta_pow compute_neutrino_power_spectrum(const double Time, const double BoxSi
   /*We calculate the power spectrum at every timestep
    * because we need it as input to the neutrino power spectrum.
    * This function stores the total power*no. modes.*/
-  nk_in = total_powerspectrum(pmgrid, fft_of_rhogrid, nk_allocated, slabstart_y, nslab_y, delta_cdm_curr, count, keff, MYMPI_COMM_WORLD);
+  _powerspectrum_reduction red;
+  total_powerspectrum_scale_start(layout, fft_of_rhogrid, nk_allocated, table, &red, MYMPI_COMM_WORLD);
+  nk_in = total_powerspectrum_finish(&red, delta_cdm_curr, count, keff);
   /*Don't need count memory any more*/
   myfree(count);
   /*Get delta_cdm_curr , which is P(k)^1/2, and convert P(k) to physical units. */
@@ -98,7 +125,7 @@ _delta_pow compute_neutrino_power_spectrum(const double Time, const double BoxSi
       delta_cdm_last[i] = delta_cdm_curr[i];
       keff[i] *= (2*M_PI/BoxSize);
   }
-  return compute_neutrino_power_internal(Time, keff, delta_cdm_curr,delta_nu_curr, nk_in);
+  return compute_neutrino_power_internal(Time, keff, delta_cdm_curr,delta_nu_curr, nk_in, MYMPI_COMM_WORLD);
 }
 
 /* This function calculates the matter power spectrum and stores it in the global d_pow.
@@ -145,47 +172,58 @@ void compute_total_power_spectrum(const double Time, const double BoxSize, fftw_
 
 /* This function adds the neutrino power spectrum to the
  * density grid. It calls the internal power spectrum routine and the neutrino integrator.
- * It then adds the neutrino power to fft_of_rhogrid, which is the fourier transformed density grid from the PM code.
+ * It then adds the neutrino power to fft_of_grid, which is the fourier transformed density grid from the PM code.
  * Arguments:
  * Time - scale factor, a.
  * BoxSize - size of the box in internal units.
- * fft_of_rhogrid - Fourier transformed density grid.
- * pmgrid - size of one dimension of the density grid.
- * slabstart_y - for slab parallelized FFT routines, this is the start index of the FFT on this rank.
- * nslab_y - number of elements of the FFT on this rank.
+ * fft_of_grid - Fourier transformed density grid.
+ * layout - which part of the grid is on this rank, and how it is stored.
  * MYMPI_COMM_WORLD - MPI communicator to use
  */
-void add_nu_power_to_rhogrid(const double Time, const double BoxSize, fftw_complex *fft_of_rhogrid, const int pmgrid, int slabstart_y, int nslab_y, MPI_Comm MYMPI_COMM_WORLD)
+void add_nu_power_to_grid(const double Time, const double BoxSize, fftw_complex *fft_of_grid, const _kspace_layout * layout, MPI_Comm MYMPI_COMM_WORLD)
 {
-  int x,y,z;
-  d_pow = compute_neutrino_power_spectrum(Time, BoxSize, fft_of_rhogrid, pmgrid, slabstart_y, nslab_y, MYMPI_COMM_WORLD);
-  /*Add P_nu to fft_of_rhgrid*/
-  for(y = slabstart_y; y < slabstart_y + nslab_y; y++)
-    for(x = 0; x < pmgrid; x++)
-      for(z = 0; z < pmgrid / 2 + 1; z++)
-        {
-          double kx,ky,kz,k2,smth;
-          int ip;
-          kx = x > pmgrid/2 ? x-pmgrid : x;
-          ky = y > pmgrid/2 ? y-pmgrid : y;
-          kz = z > pmgrid/2 ? z-pmgrid : z;
-
-          k2 = kx*kx + ky*ky + kz*kz;
-          if(k2 <= 0)
-              continue;
-          /*Change the units of k to match those of logkk*/
-          k2=log(sqrt(k2)*2*M_PI/BoxSize);
-          /* Note get_neutrino_powerspec returns delta_nu / P_cdm^1/2, which is dimensionless.
-           * We have delta_t = (M_cdm+M_nu)*delta_cdm (1-f_nu + f_nu (delta_nu / delta_cdm)^1/2)
-           * which gives the right power spectrum, once we divide by
-           * M_cdm +M_nu in powerspec*/
-          smth=(1+get_dnudcdm_powerspec(&d_pow, k2));
-          if(isnan(smth))
-                terminate(5,"delta_nu or delta_cdm is nan\n");
-          ip = pmgrid * (pmgrid / 2 + 1) * (y - slabstart_y) + (pmgrid / 2 + 1) * x + z;
-          fft_of_rhogrid[ip].re *= smth;
-          fft_of_rhogrid[ip].im *= smth;
-        }
+  int k2;
+  /*The largest k^2 on the grid, in units of the fundamental mode*/
+  const int nk2 = 3*(layout->dims/2)*(layout->dims/2)+1;
+  /*If we have the neutrino power from the previous step, apply it while computing the power spectrum.*/
+  const int lagged = kspace_params.lagged_ratio && lagged_nk2 == nk2;
+  /*Allocate the table which stores the factor for the next step.
+   * This is kept between steps, so it cannot live on the mymalloc stack,
+   * which must be freed in reverse order of allocation.*/
+  if(kspace_params.lagged_ratio && !lagged) {
+      free(lagged_k2_table);
+      lagged_k2_table = malloc(nk2*sizeof(double));
+      if(!lagged_k2_table)
+          terminate(1,"Could not allocate memory for the lagged neutrino k^2 table\n");
+      lagged_nk2 = nk2;
+  }
+  d_pow = compute_neutrino_power_spectrum(Time, BoxSize, fft_of_grid, layout, lagged ? lagged_k2_table : NULL, MYMPI_COMM_WORLD);
+  /* Every mode has integer k^2 = kx^2+ky^2+kz^2, so compute the factor for each k^2 once.
+   * Note get_neutrino_powerspec returns delta_nu / P_cdm^1/2, which is dimensionless.
+   * We have delta_t = (M_cdm+M_nu)*delta_cdm (1-f_nu + f_nu (delta_nu / delta_cdm)^1/2)
+   * which gives the right power spectrum, once we divide by
+   * M_cdm +M_nu in powerspec*/
+  double * smth = mymalloc("nu_k2_table", nk2*sizeof(double));
+  if(!smth)
+      terminate(1,"Could not allocate memory for the neutrino k^2 table\n");
+  get_dnudcdm_k2_table(&d_pow, 2*M_PI/BoxSize, nk2, smth);
+  for(k2 = 0; k2 < nk2; k2++)
+      if(isnan(smth[k2]))
+          terminate(5,"delta_nu or delta_cdm is nan\n");
+  if(lagged) {
+      /*The grid has already been multiplied by the factor from the last step. The difference from this step is the error from the lag.*/
+      double maxerr = 0;
+      for(k2 = 1; k2 < nk2; k2++)
+          maxerr = fmax(maxerr, fabs(lagged_k2_table[k2]/smth[k2] - 1));
+      message(0,"Lagged neutrino power: max relative error in grid factor %g\n", maxerr);
+  }
+  else
+      /*Add P_nu to fft_of_grid.*/
+      kspace_layout_multiply_k2(layout, fft_of_grid, smth);
+  /*Store the factor for the next step*/
+  if(kspace_params.lagged_ratio)
+      memcpy(lagged_k2_table, smth, nk2*sizeof(double));
+  myfree(smth);
   MPI_Barrier(MYMPI_COMM_WORLD);
   message(0,"Done adding neutrinos to grid on all processors\n");
   /*Free memory*/
@@ -193,6 +231,24 @@ void add_nu_power_to_rhogrid(const double Time, const double BoxSize, fftw_compl
   return;
 }
 
+/* This function adds the neutrino power spectrum to the
+ * density grid, for the slab-decomposed FFTW2 grid of Gadget.
+ * Arguments:
+ * Time - scale factor, a.
+ * BoxSize - size of the box in internal units.
+ * fft_of_rhogrid - Fourier transformed density grid.
+ * pmgrid - size of one dimension of the density grid.
+ * slabstart_y - for slab parallelized FFT routines, this is the start index of the FFT on this rank.
+ * nslab_y - number of elements of the FFT on this rank.
+ * MYMPI_COMM_WORLD - MPI communicator to use
+ */
+void add_nu_power_to_rhogrid(const double Time, const double BoxSize, fftw_complex *fft_of_rhogrid, const int pmgrid, int slabstart_y, int nslab_y, MPI_Comm MYMPI_COMM_WORLD)
+{
+  _kspace_layout layout;
+  kspace_layout_slab(&layout, pmgrid, slabstart_y, nslab_y);
+  add_nu_power_to_grid(Time, BoxSize, fft_of_rhogrid, &layout, MYMPI_COMM_WORLD);
+}
+
 int save_total_power(const double Time, const int snapnum, const char * OutputDir)
 {
     FILE *fd;
@@ -9,6 +9,7 @@
 #endif
 
 #include "interface_common.h"
+#include "powerspectrum.h"
 
 /*We only need this for fftw_complex*/
 #ifdef NOTYPEPREFIX_FFTW
@@ -37,6 +38,16 @@
  */
 void add_nu_power_to_rhogrid(const double Time, const double BoxSize, fftw_complex *fft_of_rhogrid, const int pmgrid, int slabstart_y, int nslab_y, MPI_Comm MYMPI_COMM_WORLD);
 
+/** As add_nu_power_to_rhogrid, but for any decomposition of the Fourier transformed grid,
+ * such as the FFTW3 MPI slabs or a 2D pencil decomposition. See _kspace_layout in powerspectrum.h.
+ * @param Time scale factor, a.
+ * @param BoxSize size of the box in internal units.
+ * @param fft_of_grid Fourier transformed density grid.
+ * @param layout which part of the grid is on this rank, and how it is stored.
+ * @param MYMPI_COMM_WORLD MPI communicator to use
+ */
+void add_nu_power_to_grid(const double Time, const double BoxSize, fftw_complex *fft_of_grid, const _kspace_layout * layout, MPI_Comm MYMPI_COMM_WORLD);
+
 /** Function which sets up the parameter reader to read kspace neutrino parameters from the parameter file. 
  * It will store them in a static variable, kspace_params, in the translation unit where the function is defined
  * (which is the same as the above functions).
@@ -6,6 +6,7 @@
 #include <gsl/gsl_integration.h>
 #include <gsl/gsl_errno.h>
 #include <string.h>
+#include "uniform_interp.h"
 
 #define HBAR    6.582119e-16  /*hbar in units of eV s*/
 #define STEFAN_BOLTZMANN 5.670373e-5
@@ -95,6 +96,16 @@ double rho_nu_int(double q, void * params)
         return q*q*epsilon*f0;
 }
 
+/*Integrand for the derivative of a^4 rho_nu with respect to log a, with the same parameters as above.*/
+static double rho_nu_deriv_int(double q, void * params)
+{
+        double amnu = *((double *)params);
+        double kT = *((double *)params+1);
+        double epsilon = sqrt(q*q+amnu*amnu);
+        double f0 = 1./(exp(q/kT)+1);
+        return q*q*amnu*amnu/epsilon*f0;
+}
+
 /*Get the conversion factor to go from (eV/c)^4 to g/cm^3
  * for a **single** neutrino species. */
 double get_rho_nu_conversion()
@@ -122,53 +133,60 @@ void rho_nu_init(_rho_nu_single * const rho_nu_tab, const double a0, const doubl
      const double logA0=log(a0)-log(1.2);
      const double logaf=log(NU_SW*kBtnu/mnu)+log(1.2);
      gsl_function F;
-     F.function = &rho_nu_int;
      /*Initialise constants*/
      rho_nu_tab->mnu = mnu;
+     rho_nu_tab->convert = get_rho_nu_conversion();
+     rho_nu_tab->loga = NULL;
      /*Shortcircuit if we don't need to do the integration*/
      if(mnu < 1e-6*kBtnu || logaf < logA0)
          return;
 
      /*Allocate memory for arrays*/
-     rho_nu_tab->loga = mymalloc("rho_nu_table",2*NRHOTAB*sizeof(double));
-     rho_nu_tab->rhonu = rho_nu_tab->loga+NRHOTAB;
-     rho_nu_tab->acc = gsl_interp_accel_alloc();
-     rho_nu_tab->interp=gsl_interp_alloc(gsl_interp_cspline,NRHOTAB);
-     if(!rho_nu_tab->interp || !rho_nu_tab->acc || !rho_nu_tab->loga)
+     rho_nu_tab->loga = mymalloc("rho_nu_table",3*NRHOTAB*sizeof(double));
+     rho_nu_tab->logrhonu = rho_nu_tab->loga+NRHOTAB;
+     rho_nu_tab->dlogrhonu = rho_nu_tab->loga+2*NRHOTAB;
+     rho_nu_tab->dloga = (logaf-logA0)/(NRHOTAB-1);
+     if(!rho_nu_tab->loga)
          terminate(2035,"Could not initialise tables for neutrino matter density\n");
 
      gsl_integration_workspace * w = gsl_integration_workspace_alloc (GSL_VAL);
      for(i=0; i< NRHOTAB; i++){
-        double param[2];
-        rho_nu_tab->loga[i]=logA0+i*(logaf-logA0)/(NRHOTAB-1);
+        double param[2], rho, drho;
+        rho_nu_tab->loga[i]=logA0+i*rho_nu_tab->dloga;
         param[0]=mnu*exp(rho_nu_tab->loga[i]);
         param[1] = kBtnu;
         F.params = &param;
-        gsl_integration_qag (&F, 0, 500*kBtnu,0 , 1e-9,GSL_VAL,6,w,&(rho_nu_tab->rhonu[i]), &abserr);
-        rho_nu_tab->rhonu[i]=rho_nu_tab->rhonu[i]/pow(exp(rho_nu_tab->loga[i]),4)*get_rho_nu_conversion();
+        F.function = &rho_nu_int;
+        gsl_integration_qag (&F, 0, 500*kBtnu,0 , 1e-9,GSL_VAL,6,w,&rho, &abserr);
+        /* rho_nu = convert * integral / a^4, and only the mass term in the integral depends on a, so
+         * d log rho_nu / d log a = -4 + (integral of q^2 (a m)^2 / epsilon f0) / (integral of q^2 epsilon f0)*/
+        F.function = &rho_nu_deriv_int;
+        gsl_integration_qag (&F, 0, 500*kBtnu,0 , 1e-9,GSL_VAL,6,w,&drho, &abserr);
+        rho_nu_tab->logrhonu[i] = log(rho/pow(exp(rho_nu_tab->loga[i]),4)*rho_nu_tab->convert);
+        rho_nu_tab->dlogrhonu[i] = -4 + drho/rho;
      }
      gsl_integration_workspace_free (w);
-     gsl_interp_init(rho_nu_tab->interp,rho_nu_tab->loga,rho_nu_tab->rhonu,NRHOTAB);
      return;
 }
 
-/*Heavily non-relativistic*/
-inline double non_rel_rho_nu(const double a, const double kT, const double amnu, const double kTamnu2)
+/*Heavily non-relativistic. convert is get_rho_nu_conversion().*/
+static inline double non_rel_rho_nu(const double a, const double kT, const double amnu, const double kTamnu2, const double convert)
 {
     /*The constants are Riemann zetas: 3,5,7 respectively*/
-    return amnu*(kT*kT*kT)/(a*a*a*a)*(1.5*1.202056903159594+kTamnu2*45./4.*1.0369277551433704+2835./32.*kTamnu2*kTamnu2*1.0083492773819229+80325/32.*kTamnu2*kTamnu2*kTamnu2*1.0020083928260826)*get_rho_nu_conversion();
+    return amnu*(kT*kT*kT)/(a*a*a*a)*(1.5*1.202056903159594+kTamnu2*45./4.*1.0369277551433704+2835./32.*kTamnu2*kTamnu2*1.0083492773819229+80325/32.*kTamnu2*kTamnu2*kTamnu2*1.0020083928260826)*convert;
 }
 
 /*Heavily relativistic: we could be more accurate here,
  * but in practice this will only be called for massless neutrinos, so don't bother.*/
-inline double rel_rho_nu(const double a, const double kT)
+static inline double rel_rho_nu(const double a, const double kT, const double convert)
 {
-    return 7*pow(M_PI*kT/a,4)/120.*get_rho_nu_conversion();
+    const double kTa = M_PI*kT/a;
+    return 7*(kTa*kTa)*(kTa*kTa)/120.*convert;
 }
 
 /*Finds the physical density in neutrinos for a single neutrino species
   1.878 82(24) x 10-29 h02 g/cm3 = 1.053 94(13) x 104 h02 eV/cm3*/
-double rho_nu(_rho_nu_single * rho_nu_tab, const double a, const double kT)
+double rho_nu(const _rho_nu_single * rho_nu_tab, const double a, const double kT)
 {
         double rho_nu_val;
         double amnu=a*rho_nu_tab->mnu;
@@ -179,11 +197,11 @@ double rho_nu(_rho_nu_single * rho_nu_tab, const double a, const double kT)
          * Don't go lower than 50 here. */
         if(NU_SW*NU_SW*kTamnu2 < 1){
             /*Heavily non-relativistic*/
-            rho_nu_val = non_rel_rho_nu(a, kT, amnu, kTamnu2);
+            rho_nu_val = non_rel_rho_nu(a, kT, amnu, kTamnu2, rho_nu_tab->convert);
         }
         else if(amnu < 1e-6*kT){
             /*Heavily relativistic*/
-            rho_nu_val=rel_rho_nu(a, kT);
+            rho_nu_val=rel_rho_nu(a, kT, rho_nu_tab->convert);
         }
         else{
             const double loga = log(a);
@@ -191,12 +209,15 @@ double rho_nu(_rho_nu_single * rho_nu_tab, const double a, const double kT)
              * Use either limiting case. */
             if (!rho_nu_tab->loga || loga < rho_nu_tab->loga[0]) {
                 if(amnu < 1e-4*kT)
-                    rho_nu_val = rel_rho_nu(a,kT);
+                    rho_nu_val = rel_rho_nu(a,kT, rho_nu_tab->convert);
                 else
-                    rho_nu_val = non_rel_rho_nu(a, kT, amnu, kTamnu2);
+                    rho_nu_val = non_rel_rho_nu(a, kT, amnu, kTamnu2, rho_nu_tab->convert);
+            }
+            else {
+                /* The table is uniform in log a, so this is a direct lookup.
+                 * It only reads the table, so it is safe to call from several threads.*/
+                rho_nu_val=exp(uniform_hermite_eval(rho_nu_tab->logrhonu, rho_nu_tab->dlogrhonu, NRHOTAB, rho_nu_tab->loga[0], rho_nu_tab->dloga, loga));
             }
-            else
-                rho_nu_val=gsl_interp_eval(rho_nu_tab->interp,rho_nu_tab->loga,rho_nu_tab->rhonu,loga,rho_nu_tab->acc);
         }
         return rho_nu_val;
 }
@@ -277,3 +298,86 @@ double omega_nu_single(const _omega_nu * const omnu, const double a, int i)
     return omega_nu;
 
 }
+
+/*Number of entries per unit log a in the background table*/
+#define BACKGROUND_PER_LOGA 512
+
+/*Compute the Hubble function directly, as in the Gadget-2 patch*/
+static double background_hubble_direct(const _background_table * const bg, const double a)
+{
+    /* Matter + Lambda + curvature*/
+    double omega_tot = bg->Omega0/pow(a,3) + bg->OmegaLambda + (1.-bg->OmegaLambda-bg->Omega0)/(a*a);
+    /*Neutrinos*/
+    omega_tot += get_omega_nu(bg->omnu, a) - get_omega_nu(bg->omnu, 1)/pow(a,3);
+    /*Radiation*/
+    if(bg->radiation)
+        omega_tot += get_omegag(bg->omnu, a);
+    return bg->Hubble * sqrt(omega_tot);
+}
+
+void init_background_table(_background_table * const bg, const _omega_nu * const omnu, const double Omega0, const double OmegaLambda, const double Hubble, const int radiation, const double amin, const double amax)
+{
+    int i;
+    bg->omnu = omnu;
+    bg->Omega0 = Omega0;
+    bg->OmegaLambda = OmegaLambda;
+    bg->Hubble = Hubble;
+    bg->radiation = radiation;
+    bg->loga0 = log(amin);
+    bg->dloga = 1./BACKGROUND_PER_LOGA;
+    bg->n = ceil(BACKGROUND_PER_LOGA*(log(amax) - log(amin)))+1;
+    /*Two extra points at each end, so that the derivatives can all use central differences*/
+    const int nsample = bg->n+4;
+    bg->logH = (double *) mymalloc("background_table", 4*bg->n*sizeof(double));
+    bg->dlogH = bg->logH + bg->n;
+    bg->logomnu = bg->logH + 2*bg->n;
+    bg->dlogomnu = bg->logH + 3*bg->n;
+    double * sample = (double *) mymalloc("background_sample", 2*nsample*sizeof(double));
+    for(i=0; i < nsample; i++) {
+        const double a = exp(bg->loga0 + (i-2)*bg->dloga);
+        sample[i] = log(background_hubble_direct(bg, a));
+        sample[nsample+i] = log(get_omega_nu(omnu, a));
+    }
+    /*Derivatives from fourth order central differences, which are much more accurate than the interpolation*/
+    for(i=0; i < bg->n; i++) {
+        const double * lh = sample + i + 2;
+        const double * lo = sample + nsample + i + 2;
+        bg->logH[i] = lh[0];
+        bg->logomnu[i] = lo[0];
+        bg->dlogH[i] = (lh[-2] - 8*lh[-1] + 8*lh[1] - lh[2])/(12*bg->dloga);
+        bg->dlogomnu[i] = (lo[-2] - 8*lo[-1] + 8*lo[1] - lo[2])/(12*bg->dloga);
+    }
+    myfree(sample);
+}
+
+void free_background_table(_background_table * const bg)
+{
+    myfree(bg->logH);
+}
+
+/*Check whether log a is inside the table*/
+static inline int background_in_table(const _background_table * const bg, const double loga)
+{
+    return loga >= bg->loga0 && loga <= bg->loga0 + (bg->n-1)*bg->dloga;
+}
+
+double background_hubble(const _background_table * const bg, const double a)
+{
+    const double loga = log(a);
+    if(!background_in_table(bg, loga))
+        return background_hubble_direct(bg, a);
+    return exp(uniform_hermite_eval(bg->logH, bg->dlogH, bg->n, bg->loga0, bg->dloga, loga));
+}
+
+double background_omega_nu(const _background_table * const bg, const double a)
+{
+    const double loga = log(a);
+    if(!background_in_table(bg, loga))
+        return get_omega_nu(bg->omnu, a);
+    return exp(uniform_hermite_eval(bg->logomnu, bg->dlogomnu, bg->n, bg->loga0, bg->dloga, loga));
+}
+
+double background_omegag(const _background_table * const bg, const double a)
+{
+    return get_omegag(bg->omnu, a);
+}
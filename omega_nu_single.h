@@ -3,7 +3,6 @@
 /** \file 
  * Routines for computing the matter density in a single neutrino species*/
 
-#include <gsl/gsl_interp.h>
 #include "kspace_neutrino_const.h"
 
 /** Ratio between the massless neutrino temperature and the CMB temperature.
@@ -17,12 +16,21 @@
 #define TNUCMB     (pow(4/11.,1/3.)*1.00328)
 
 /** Tables for rho_nu (neutrino density): stores precomputed values between
- * simulation start and a M_nu = 20 kT_nu for a single neutrino species.*/
+ * simulation start and a M_nu = 20 kT_nu for a single neutrino species.
+ * The table is uniform in log a, and stores log rho_nu and its exact derivative,
+ * so a lookup is a direct index and a cubic Hermite polynomial: no search and no accelerator,
+ * so it is safe to call from several threads at once.*/
 struct _rho_nu_single {
+    /** log a at each entry*/
     double * loga;
-    double * rhonu;
-    gsl_interp * interp;
-    gsl_interp_accel * acc;
+    /** log rho_nu at each entry*/
+    double * logrhonu;
+    /** d log rho_nu / d log a at each entry*/
+    double * dlogrhonu;
+    /** Spacing of the table in log a*/
+    double dloga;
+    /** Factor converting (eV/c)^4 to g/cm^3, from get_rho_nu_conversion*/
+    double convert;
     /*Neutrino mass for this structure*/
     double mnu;
 };
@@ -42,7 +50,7 @@ void rho_nu_init(_rho_nu_single * rho_nu_tab, double a0, const double mnu, const
  * @param a Redshift desired.
  * @param kT Boltzmann constant times neutrino temperature. Dimensionful factor.
  * @returns neutrino density in g cm^-3 */
-double rho_nu(_rho_nu_single * rho_nu_tab, const double a, const double kT);
+double rho_nu(const _rho_nu_single * rho_nu_tab, const double a, const double kT);
 
 /** \section Hybrid
  * Hybrid Neutrinos: The following functions and structures are used for hybrid neutrinos only.*/
@@ -130,4 +138,61 @@ double get_omegag(const _omega_nu * const omnu, const double a);
  * @param a scale factor desired*/
 double omega_nu_single(const _omega_nu * const rho_nu_tab, const double a, const int i);
 
+/**\section Background
+ * Precomputed background expansion, for codes which would otherwise sum the neutrino species
+ * in every call to their Hubble function.*/
+/** Table of the Hubble function and neutrino density on a uniform grid in log a.
+ * log H and log Omega_nu are stored, with their derivatives in log a, and interpolated with cubic Hermite polynomials,
+ * so a lookup is O(1) and needs no GSL accelerator: it is safe to call from several threads at once.
+ * The Hubble function is that of the Gadget-2 patch: matter, curvature, Lambda, neutrinos and optionally photons.*/
+struct _background_table {
+    /** Number of entries*/
+    int n;
+    /** log of the first scale factor in the table*/
+    double loga0;
+    /** Spacing of the table in log a*/
+    double dloga;
+    /** log H(a) at each entry, and its derivative in log a*/
+    double * logH;
+    double * dlogH;
+    /** log Omega_nu(a) at each entry, and its derivative in log a*/
+    double * logomnu;
+    double * dlogomnu;
+    /** Neutrino structure, for the photon density and for lookups outside the table*/
+    const _omega_nu * omnu;
+    /** Total matter density today, including neutrinos*/
+    double Omega0;
+    /** Cosmological constant density*/
+    double OmegaLambda;
+    /** Hubble constant in internal units*/
+    double Hubble;
+    /** If true, include the photon density in H(a)*/
+    int radiation;
+};
+typedef struct _background_table _background_table;
+
+/** Initialise the background table between amin and amax. Allocates memory.
+ * @param bg Structure to initialise.
+ * @param omnu Initialised neutrino structure. Must remain valid while the table is used.
+ * @param Omega0 Total matter density today, including neutrinos.
+ * @param OmegaLambda Cosmological constant density. Curvature is 1 - Omega0 - OmegaLambda.
+ * @param Hubble Hubble constant in internal units (eg, HUBBLE * UnitTime_in_s).
+ * @param radiation If true, include the photons in H(a).
+ * @param amin First scale factor in the table.
+ * @param amax Last scale factor in the table.*/
+void init_background_table(_background_table * const bg, const _omega_nu * const omnu, const double Omega0, const double OmegaLambda, const double Hubble, const int radiation, const double amin, const double amax);
+
+/** Free the memory allocated by init_background_table.*/
+void free_background_table(_background_table * const bg);
+
+/** Hubble function H(a) in internal units. Outside the table this is computed directly.*/
+double background_hubble(const _background_table * const bg, const double a);
+
+/** Total matter density in neutrinos at scale factor a, as get_omega_nu.
+ * Outside the table this is computed directly.*/
+double background_omega_nu(const _background_table * const bg, const double a);
+
+/** Photon density at scale factor a, as get_omegag. This is a power law, so needs no table.*/
+double background_omegag(const _background_table * const bg, const double a);
+
 #endif
@@ -18,13 +18,18 @@ static void test_rho_nu_init(void **state) {
     rho_nu_init(&rho_nu_tab, 0.01, mnu, 0.7,BOLEVK*TNUCMB*T_CMB0);
     /*Check everything initialised ok*/
     assert_true(rho_nu_tab.mnu == mnu);
-    assert_true(rho_nu_tab.acc);
-    assert_true(rho_nu_tab.interp);
     assert_true(rho_nu_tab.loga);
-    assert_true(rho_nu_tab.rhonu);
-    /*Check that loga is correctly ordered (or interpolation won't work)*/
+    assert_true(rho_nu_tab.logrhonu);
+    assert_true(rho_nu_tab.dlogrhonu);
+    /*Check that loga is uniformly spaced (or interpolation won't work)*/
     for(int i=1; i<200; i++){
-        assert_true(rho_nu_tab.loga[i] > rho_nu_tab.loga[i-1]);
+        assert_true(fabs(rho_nu_tab.loga[i] - rho_nu_tab.loga[i-1] - rho_nu_tab.dloga) < 1e-12);
+    }
+    /*Check the derivative against a finite difference: rho_nu goes from a^-4 to a^-3*/
+    for(int i=1; i<199; i++){
+        const double fd = (rho_nu_tab.logrhonu[i+1] - rho_nu_tab.logrhonu[i-1])/(2*rho_nu_tab.dloga);
+        assert_true(fabs(rho_nu_tab.dlogrhonu[i] - fd) < 1e-3);
+        assert_true(rho_nu_tab.dlogrhonu[i] <= -3 && rho_nu_tab.dlogrhonu[i] >= -4);
     }
 }
 /*Check massless neutrinos work*/
@@ -186,6 +191,26 @@ static void test_hybrid_neutrinos(void **state)
     assert_true(fabs(omega_nu_single(&omnu, 0.499999, 0)*(1-nufrac_part)/omega_nu_single(&omnu, 0.500001, 0)-1) < 1e-4);
 }
 
+/*Check the background table against direct computation*/
+static void test_background_table(void **state)
+{
+    _omega_nu omnu;
+    double MNu[3] = {0.05,0.1,0.2};
+    const double Omega0 = 0.3, HubbleParam = 0.7, Hubble = 0.1;
+    init_omega_nu(&omnu, MNu, 0.01, HubbleParam,T_CMB0);
+    _background_table bg;
+    init_background_table(&bg, &omnu, Omega0, 1-Omega0, Hubble, 1, 0.01, 1);
+    for(double a = 0.009; a < 1.05; a*=1.0123) {
+        /*The same formula as the Gadget-2 patch, with no curvature*/
+        const double omnua = get_omega_nu(&omnu, a);
+        const double H = Hubble * sqrt((Omega0 - get_omega_nu(&omnu, 1))/pow(a,3) + 1 - Omega0 + omnua + get_omegag(&omnu, a));
+        assert_true(fabs(background_hubble(&bg, a)/H - 1) < 1e-8);
+        /*rho_nu has a small jump where it switches to the non-relativistic expansion, so this is a little worse*/
+        assert_true(fabs(background_omega_nu(&bg, a)/omnua - 1) < 1e-7);
+        assert_true(background_omegag(&bg, a) == get_omegag(&omnu, a));
+    }
+    free_background_table(&bg);
+}
 
 int main(void) {
     const struct CMUnitTest tests[] = {
@@ -198,6 +223,7 @@ int main(void) {
         cmocka_unit_test(test_omega_nu_single_exact),
         cmocka_unit_test(test_nufrac_low),
         cmocka_unit_test(test_hybrid_neutrinos),
+        cmocka_unit_test(test_background_table),
     };
     return cmocka_run_group_tests(tests, NULL, NULL);
 }
@@ -1,5 +1,7 @@
 #include <math.h>
+#include <stdlib.h>
 #include <string.h>
+#include <limits.h>
 #include <gsl/gsl_interp.h>
 #include "powerspectrum.h"
 #include "gadget_defines.h"
@@ -26,82 +28,322 @@ fftw_real invwindow(int kx, int ky, int kz, int n)
 /**Little macro to work the storage order of the FFT.*/
 #define KVAL(n) ((n)<=dims/2 ? (n) : ((n)-dims))
 
-/* This computes the power in an array on one processor, for an MPI transform.
- * Returns the number of bins with non-zero mode counts.
- * The power spectrum returned is normalised conventionally, and
- * reordered to omit zero bins.*/
-int total_powerspectrum(const int dims, fftw_complex *outfield, const int nrbins, const int startslab, const int nslab, double *power, long long int *count, double *keffs, MPI_Comm MYMPI_COMM_WORLD)
+void kspace_layout_init(_kspace_layout * layout, const int dims, const int start[3], const int nlocal[3], const ptrdiff_t stride[3])
+{
+    int i;
+    layout->dims = dims;
+    for(i=0; i<3; i++) {
+        const int len = (i == 2 ? dims/2+1 : dims);
+        if(start[i] < 0 || nlocal[i] < 0 || start[i]+nlocal[i] > len)
+            terminate(2030,"Local block %d + %d of k-space axis %d does not fit in a grid of size %d\n", start[i], nlocal[i], i, len);
+        layout->start[i] = start[i];
+        layout->nlocal[i] = nlocal[i];
+        layout->stride[i] = stride[i];
+    }
+}
+
+void kspace_layout_pencil(_kspace_layout * layout, const int dims, const int start0, const int n0, const int start1, const int n1)
+{
+    const int start[3] = {start0, start1, 0};
+    const int nlocal[3] = {n0, n1, dims/2+1};
+    const ptrdiff_t stride[3] = {(ptrdiff_t) n1*(dims/2+1), dims/2+1, 1};
+    kspace_layout_init(layout, dims, start, nlocal, stride);
+}
+
+void kspace_layout_slab(_kspace_layout * layout, const int dims, const int slabstart, const int nslab)
+{
+    kspace_layout_pencil(layout, dims, slabstart, nslab, 0, dims);
+}
+
+/*Offset of the first mode of the row (x,y) of the local block, where x and y are global indices.*/
+static inline ptrdiff_t kspace_layout_row(const _kspace_layout * layout, const int x, const int y)
+{
+    return (x - layout->start[0])*layout->stride[0] + (y - layout->start[1])*layout->stride[1];
+}
+
+void kspace_layout_multiply_k2(const _kspace_layout * layout, fftw_complex * field, const double table[])
 {
-    /*First we sum the power on this processor, then we do an MPI_allgather*/
-    double powerpriv[nrbins];
-    double keffspriv[nrbins];
-    long long int countpriv[nrbins];
+    const int dims = layout->dims;
+    const int zstart = layout->start[2];
+    const int zend = layout->start[2] + layout->nlocal[2];
+    const ptrdiff_t zstride = layout->stride[2];
+    #pragma omp parallel for collapse(2)
+    for(int x = layout->start[0]; x < layout->start[0] + layout->nlocal[0]; x++)
+        for(int y = layout->start[1]; y < layout->start[1] + layout->nlocal[1]; y++) {
+            const int kxy2 = KVAL(x)*KVAL(x) + KVAL(y)*KVAL(y);
+            fftw_complex * row = field + kspace_layout_row(layout, x, y);
+            /*kz = z, since z <= dims/2.*/
+            #pragma omp simd
+            for(int z = zstart; z < zend; z++) {
+                const double fac = table[kxy2 + z*z];
+                row[(z-zstart)*zstride].re *= fac;
+                row[(z-zstart)*zstride].im *= fac;
+            }
+        }
+}
+
+/*Power spectrum bin for a mode with |k|^2 = k2, in units of the fundamental mode.*/
+static inline int ps_bin(const long long k2, const double binsperunit)
+{
+    return floor(binsperunit*log(sqrt((double) k2)));
+}
+
+/* The geometry of the part of the grid on this processor, which depends only on the layout and the number of bins.
+ * It is the same on every PM step, so is computed once and stored.
+ * The bin index increases along each row of modes in z, so it is stored run-length encoded:
+ * each row is a list of runs of consecutive modes which fall in the same bin.*/
+struct _kspace_bin_cache {
+    _kspace_layout layout;
+    int nrbins;
+    int nrow;
+    /*Weight of each mode in z: the window function and the number of times the mode counts.*/
+    double * zweight;
+    /*Window function of each row in x and y.*/
+    double * rowweight;
+    /*Sum of |k| and number of modes in each bin, on this processor. These do not depend on the field.*/
+    double * keffs;
+    double * count;
+    /*Offset of the first mode of each row.*/
+    ptrdiff_t * rowoffset;
+    /*kx^2+ky^2 of each row.*/
+    int * rowk2;
+    /*Runs of each row are rowrun[r] to rowrun[r+1]. Row r = x*nlocal[1]+y.*/
+    int * rowrun;
+    /*Bin and number of modes in each run. Bin -1 is the k=0 mode, which is not included.*/
+    int * runbin;
+    int * runlen;
+};
+
+static struct _kspace_bin_cache bin_cache;
+
+void free_powerspectrum_cache(void)
+{
+    free(bin_cache.zweight);
+    memset(&bin_cache, 0, sizeof(bin_cache));
+}
+
+/*Bin of the mode with |k|^2 = k2, or -1 for the k=0 mode. binedge[nrbins] is past the largest k^2, so the walk stays in range.*/
+static inline int walk_bin(const long long binedge[], int psindex, const long long k2)
+{
+    if(k2 == 0)
+        return -1;
+    if(psindex < 0)
+        psindex = 0;
+    while(binedge[psindex+1] <= k2)
+        psindex++;
+    return psindex;
+}
+
+/*Compare two layouts field by field: memcmp would also compare the padding before stride, which need not match.*/
+static int kspace_layout_equal(const _kspace_layout * a, const _kspace_layout * b)
+{
+    int i;
+    if(a->dims != b->dims)
+        return 0;
+    for(i = 0; i < 3; i++)
+        if(a->start[i] != b->start[i] || a->nlocal[i] != b->nlocal[i] || a->stride[i] != b->stride[i])
+            return 0;
+    return 1;
+}
+
+/* Get the geometry of the grid, computing it if the layout or the binning has changed.*/
+static const struct _kspace_bin_cache * get_bin_cache(const _kspace_layout * layout, const int nrbins)
+{
+    if(bin_cache.zweight && bin_cache.nrbins == nrbins && kspace_layout_equal(&bin_cache.layout, layout))
+        return &bin_cache;
+    free_powerspectrum_cache();
+    const int dims = layout->dims;
+    const int nz = layout->nlocal[2];
+    const int nrow = layout->nlocal[0]*layout->nlocal[1];
+    /*First integer k^2 in each bin, plus one past the largest k^2.*/
+    long long binedge[nrbins+1];
+    /* Inverse window function for each axis, to the fourth power as it is squared in the power.
+     * The grid is the same in all three directions, so one table serves for every axis.*/
+    double window4[dims];
     /*How many bins per unit (log) interval in k?*/
     const double binsperunit=(nrbins-1)/log(sqrt(3)*dims/2.0);
-    int i, nonzero;
-    double total_mass2 = 0;
-    /* First element of the FFT stores the total mass, on the processor with the first slab.
+    const long long maxk2 = 3*(long long)(dims/2)*(dims/2);
+    int i, r, z;
+    for(i=0; i<dims; i++) {
+        const double iw = onedinvwindow(KVAL(i), dims);
+        window4[i] = (iw*iw)*(iw*iw);
+    }
+    /* Every mode has integer k^2, and the bin increases with k^2, so find the first k^2 in each bin.
+     * Then the bin of each mode is found by comparing integers, instead of a log per mode.
+     * The edges are found using the same expression for the bin as before, so that the binning is identical.*/
+    for(i=0; i<=nrbins; i++) {
+        long long lo = 1, hi = maxk2+1;
+        /*Find the smallest k2 in [1, maxk2+1) with ps_bin(k2) >= i, or maxk2+1 if there is none*/
+        while(lo < hi) {
+            const long long mid = lo + (hi - lo)/2;
+            if(ps_bin(mid, binsperunit) >= i)
+                hi = mid;
+            else
+                lo = mid+1;
+        }
+        binedge[i] = lo;
+    }
+    /*Count the runs in each row, so we know how much memory to allocate.*/
+    long long nrun = 0;
+    for(r=0; r<nrow; r++) {
+        const int x = layout->start[0] + r/layout->nlocal[1];
+        const int y = layout->start[1] + r%layout->nlocal[1];
+        const long long kxy2 = (long long) KVAL(x)*KVAL(x) + (long long) KVAL(y)*KVAL(y);
+        int psindex = -2;
+        for(z=layout->start[2]; z<layout->start[2]+nz; z++) {
+            const int bin = walk_bin(binedge, psindex, kxy2 + (long long) z*z);
+            if(bin != psindex)
+                nrun++;
+            psindex = bin;
+        }
+    }
+    if(nrun > INT_MAX)
+        terminate(2031,"Too many runs of power spectrum bins: %lld\n", nrun);
+    /*One allocation, with the doubles first so everything is aligned.
+     *This is kept between PM steps, so use malloc rather than mymalloc, which must be freed in the reverse order of allocation.*/
+    const size_t bytes = (nz + nrow + 2*nrbins)*sizeof(double) + nrow*sizeof(ptrdiff_t) + (2*nrow+1 + 2*nrun)*sizeof(int);
+    bin_cache.zweight = malloc(bytes);
+    if(!bin_cache.zweight)
+        terminate(1,"Could not allocate memory for power spectrum cache\n");
+    bin_cache.rowweight = bin_cache.zweight + nz;
+    bin_cache.keffs = bin_cache.rowweight + nrow;
+    bin_cache.count = bin_cache.keffs + nrbins;
+    bin_cache.rowoffset = (ptrdiff_t *) (bin_cache.count + nrbins);
+    bin_cache.rowk2 = (int *) (bin_cache.rowoffset + nrow);
+    bin_cache.rowrun = bin_cache.rowk2 + nrow;
+    bin_cache.runbin = bin_cache.rowrun + nrow+1;
+    bin_cache.runlen = bin_cache.runbin + nrun;
+    bin_cache.layout = *layout;
+    bin_cache.nrbins = nrbins;
+    bin_cache.nrow = nrow;
+    memset(bin_cache.keffs, 0, 2*nrbins*sizeof(double));
+    /* The k=0 and N/2 mode need special treatment here,
+     * as they alone are not doubled. Because of the symmetry, each other mode counts twice.*/
+    for(z=0; z<nz; z++) {
+        const int gz = layout->start[2] + z;
+        bin_cache.zweight[z] = ((gz == 0 || gz == dims/2) ? 1 : 2) * window4[gz];
+    }
+    int run = -1;
+    for(r=0; r<nrow; r++) {
+        const int x = layout->start[0] + r/layout->nlocal[1];
+        const int y = layout->start[1] + r%layout->nlocal[1];
+        const long long kxy2 = (long long) KVAL(x)*KVAL(x) + (long long) KVAL(y)*KVAL(y);
+        int psindex = -2;
+        bin_cache.rowweight[r] = window4[x]*window4[y];
+        bin_cache.rowoffset[r] = kspace_layout_row(layout, x, y);
+        bin_cache.rowk2[r] = kxy2;
+        bin_cache.rowrun[r] = run+1;
+        for(z=layout->start[2]; z<layout->start[2]+nz; z++) {
+            const long long k2 = kxy2 + (long long) z*z;
+            const int bin = walk_bin(binedge, psindex, k2);
+            if(bin != psindex) {
+                run++;
+                bin_cache.runbin[run] = bin;
+                bin_cache.runlen[run] = 0;
+            }
+            bin_cache.runlen[run]++;
+            psindex = bin;
+            if(bin >= 0) {
+                const int mult = (z == 0 || z == dims/2) ? 1 : 2;
+                bin_cache.keffs[bin] += mult*sqrt((double) k2);
+                bin_cache.count[bin] += mult;
+            }
+        }
+    }
+    bin_cache.rowrun[nrow] = run+1;
+    return &bin_cache;
+}
+
+/* This computes the power in the part of the grid on this processor,
+ * and starts the (non-blocking) sum of the power over all processors.
+ * If table is not NULL, each mode is multiplied by table[k^2] after its power is added, so that the grid is only read once.
+ * The sums are packed into one buffer: power, keffs and counts for each bin, then the total mass,
+ * so only one reduction is needed. The counts are stored as doubles, which are exact up to 2^53 modes.*/
+void total_powerspectrum_scale_start(const _kspace_layout * layout, fftw_complex *outfield, const int nrbins, const double * table, _powerspectrum_reduction * red, MPI_Comm MYMPI_COMM_WORLD)
+{
+    const struct _kspace_bin_cache * cache = get_bin_cache(layout, nrbins);
+    const ptrdiff_t zstride = layout->stride[2];
+    const int zstart = layout->start[2];
+    /*First we sum the power on this processor, then we do an MPI_Iallreduce*/
+    double * sums = mymalloc("powerspectrum_sums", (3*nrbins+1)*sizeof(double));
+    if(!sums)
+        terminate(1,"Could not allocate memory for power spectrum sums\n");
+    double * powerpriv = sums;
+    /* The k=0 mode stores the total mass, on the processor with the first block in every direction.
      * Note this may not be the rank 0 processor! */
-    if(startslab == 0){
-        total_mass2 = outfield[0].re*outfield[0].re + outfield[0].im*outfield[0].im;
+    sums[3*nrbins] = 0;
+    if(layout->start[0] == 0 && layout->start[1] == 0 && layout->start[2] == 0 && layout->nlocal[0] && layout->nlocal[1] && layout->nlocal[2]){
+        sums[3*nrbins] = outfield[0].re*outfield[0].re + outfield[0].im*outfield[0].im;
     }
     /* Now we compute the powerspectrum in each direction.
      * FFTW is unnormalised, so we need to scale by the length of the array
-     * (we do this later). */
+     * (we do this later). The mode counts and k values depend only on the grid, so come from the cache. */
     memset(powerpriv, 0, nrbins*sizeof(double));
-    memset(countpriv, 0, nrbins*sizeof(long long int));
-    memset(keffspriv, 0, nrbins*sizeof(double));
+    memcpy(sums+nrbins, cache->keffs, 2*nrbins*sizeof(double));
     /* Want P(k)= F(k).re*F(k).re+F(k).im*F(k).im
-     * Use the symmetry of the real fourier transform to half the final dimension.*/
-    for(i=startslab; i<startslab+nslab;i++){
-        int j, indx=(i-startslab)*dims*(dims/2+1);
-        for(j=0; j<dims; j++){
-            int k, indy=j*(dims/2+1);
-            /* The k=0 and N/2 mode need special treatment here,
-                * as they alone are not doubled.*/
-            /*Do k=0 mode.*/
-            int index=indx+indy;
-            double kk=sqrt(pow(KVAL(i),2)+pow(KVAL(j),2));
-            /*We don't want the 0,0,0 mode as that is just the mean of the field.*/
-            if (kk > 0) {
-                int psindex=floor(binsperunit*log(kk));
-                powerpriv[psindex] += (outfield[index].re*outfield[index].re+outfield[index].im*outfield[index].im)*pow(invwindow(KVAL(i),KVAL(j),0,dims),2);
-                keffspriv[psindex]+=kk;
-                countpriv[psindex]++;
+     * Use the symmetry of the real fourier transform to half the final dimension.
+     * Each thread sums into its own copy of the histogram, which are added together at the end.*/
+    #pragma omp parallel for reduction(+:powerpriv[:nrbins])
+    for(int r=0; r<cache->nrow; r++){
+        fftw_complex * row = outfield + cache->rowoffset[r];
+        const int kxy2 = cache->rowk2[r];
+        int z = 0;
+        for(int run = cache->rowrun[r]; run < cache->rowrun[r+1]; run++) {
+            const int zend = z + cache->runlen[run];
+            double sum = 0;
+            if(table) {
+                for(; z < zend; z++) {
+                    fftw_complex * mode = row + z*zstride;
+                    const double fac = table[kxy2 + (z+zstart)*(z+zstart)];
+                    sum += (mode->re*mode->re+mode->im*mode->im)*cache->zweight[z];
+                    mode->re *= fac;
+                    mode->im *= fac;
+                }
             }
-            /*Now do the k=N/2 mode*/
-            index=indx+indy+dims/2;
-            kk=sqrt(pow(KVAL(i),2)+pow(KVAL(j),2)+pow(KVAL(dims/2),2));
-            int psindex=floor(binsperunit*log(kk));
-            powerpriv[psindex] += (outfield[index].re*outfield[index].re+outfield[index].im*outfield[index].im)*pow(invwindow(KVAL(i),KVAL(j),KVAL(dims/2),dims),2);
-            keffspriv[psindex]+=kk;
-            countpriv[psindex]++;
-            /*Now do the rest. Because of the symmetry, each mode counts twice.*/
-            for(k=1; k<dims/2; k++){
-                    index=indx+indy+k;
-                    kk=sqrt(pow(KVAL(i),2)+pow(KVAL(j),2)+pow(KVAL(k),2));
-                    int psindex=floor(binsperunit*log(kk));
-                    powerpriv[psindex]+=2*(outfield[index].re*outfield[index].re+outfield[index].im*outfield[index].im)*pow(invwindow(KVAL(i),KVAL(j),KVAL(k),dims),2);
-                    countpriv[psindex]+=2;
-                    keffspriv[psindex]+=2*kk;
+            else {
+                for(; z < zend; z++) {
+                    const fftw_complex mode = row[z*zstride];
+                    sum += (mode.re*mode.re+mode.im*mode.im)*cache->zweight[z];
+                }
             }
+            /*We don't want the 0,0,0 mode as that is just the mean of the field.*/
+            if(cache->runbin[run] >= 0)
+                powerpriv[cache->runbin[run]] += sum*cache->rowweight[r];
         }
     }
-    /*Now sum the different contributions*/
-    MPI_Allreduce(countpriv, count, nrbins, MPI_LONG_LONG_INT, MPI_SUM, MYMPI_COMM_WORLD);
-    MPI_Allreduce(powerpriv, power, nrbins, MPI_DOUBLE, MPI_SUM, MYMPI_COMM_WORLD);
-    MPI_Allreduce(keffspriv, keffs, nrbins, MPI_DOUBLE, MPI_SUM, MYMPI_COMM_WORLD);
-    /*Make sure total_mass is same on all processors.*/
-    MPI_Allreduce(MPI_IN_PLACE, &total_mass2, 1, MPI_DOUBLE, MPI_SUM, MYMPI_COMM_WORLD);
+    /*Now start summing the contributions from the different processors*/
+    red->sums = sums;
+    red->nrbins = nrbins;
+    MPI_Iallreduce(MPI_IN_PLACE, sums, 3*nrbins+1, MPI_DOUBLE, MPI_SUM, MYMPI_COMM_WORLD, &red->request);
+}
+
+void total_powerspectrum_start(const _kspace_layout * layout, fftw_complex *outfield, const int nrbins, _powerspectrum_reduction * red, MPI_Comm MYMPI_COMM_WORLD)
+{
+    total_powerspectrum_scale_start(layout, outfield, nrbins, NULL, red, MYMPI_COMM_WORLD);
+}
+
+/* Wait for the sum started by total_powerspectrum_start, then normalise the power spectrum
+ * and reorder it to omit zero bins. Returns the number of bins with non-zero mode counts.*/
+int total_powerspectrum_finish(_powerspectrum_reduction * red, double *power, long long int *count, double *keffs)
+{
+    int i, nonzero;
+    const int nrbins = red->nrbins;
+    MPI_Wait(&red->request, MPI_STATUS_IGNORE);
+    /*The total mass is the same on all processors.*/
+    const double total_mass2 = red->sums[3*nrbins];
     message(0,"Total powerspectrum mass: %g\n", sqrt(total_mass2));
     /*Normalise by the total mass in the array*/
     for(i=0; i<nrbins;i++) {
-        power[i]/=total_mass2;
+        power[i] = red->sums[i]/total_mass2;
+        keffs[i] = red->sums[nrbins+i];
+        count[i] = (long long int) red->sums[2*nrbins+i];
         if(count[i]) {
             keffs[i]/=count[i];
             power[i] /= count[i];
         }
     }
+    myfree(red->sums);
+    red->sums = NULL;
     /*Remove bins with zero modes*/
     for(i=0, nonzero=0; i<nrbins;i++) {
         if(count[i]) {
@@ -115,3 +357,16 @@ int total_powerspectrum(const int dims, fftw_complex *outfield, const int nrbins
     }
     return nonzero;
 }
+
+/* This computes the power in an array on one processor, for an MPI transform.
+ * Returns the number of bins with non-zero mode counts.
+ * The power spectrum returned is normalised conventionally, and
+ * reordered to omit zero bins.*/
+int total_powerspectrum(const int dims, fftw_complex *outfield, const int nrbins, const int startslab, const int nslab, double *power, long long int *count, double *keffs, MPI_Comm MYMPI_COMM_WORLD)
+{
+    _powerspectrum_reduction red;
+    _kspace_layout layout;
+    kspace_layout_slab(&layout, dims, startslab, nslab);
+    total_powerspectrum_start(&layout, outfield, nrbins, &red, MYMPI_COMM_WORLD);
+    return total_powerspectrum_finish(&red, power, count, keffs);
+}
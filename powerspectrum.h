@@ -1,5 +1,6 @@
 #ifndef POWERSPEC_H
 #define POWERSPEC_H
+#include <stddef.h>
 #include <mpi.h>
 
 /*We only need this for fftw_complex*/
@@ -13,6 +14,46 @@
 #endif
 #endif
 
+/** Describes which part of the Fourier transformed density grid is stored on this rank, and how.
+ * The grid is the real-to-complex transform of a dims^3 grid, so axes 0 and 1 have dims elements
+ * and axis 2, the one halved by the transform, has dims/2+1. This rank holds the block
+ * start[i] <= n_i < start[i] + nlocal[i] of each axis, and the mode (n_0, n_1, n_2)
+ * is stored at element sum_i (n_i - start[i]) * stride[i] of the local array.
+ * Since only |k| is used, axes 0 and 1 may be given in either order, so a transposed
+ * transform is described in the same way as an untransposed one.*/
+struct _kspace_layout {
+    int dims;
+    int start[3];
+    int nlocal[3];
+    ptrdiff_t stride[3];
+};
+typedef struct _kspace_layout _kspace_layout;
+
+/** Describe an arbitrary block decomposition of the grid.
+ * Terminates if the block does not fit in the grid.
+ * @param layout Layout to initialise.
+ * @param dims size of one dimension of the density grid.
+ * @param start first (global) index of the local block along each axis.
+ * @param nlocal number of elements of the local block along each axis.
+ * @param stride distance between consecutive elements along each axis, in units of fftw_complex.*/
+void kspace_layout_init(_kspace_layout * layout, const int dims, const int start[3], const int nlocal[3], const ptrdiff_t stride[3]);
+
+/** Describe a 2D pencil decomposition, in which the local block is start0 <= n_0 < start0+n0, start1 <= n_1 < start1 + n1,
+ * with all of axis 2, stored in row-major order with axis 2 contiguous.
+ * This is the output of the slab and pencil parallel FFTs when they do not redistribute axis 2.*/
+void kspace_layout_pencil(_kspace_layout * layout, const int dims, const int start0, const int n0, const int start1, const int n1);
+
+/** Describe a slab decomposition, in which each rank has nslab whole planes starting at slabstart.
+ * This is both the FFTW2 MPI output (slabstart_y, nslab_y) and the FFTW3 MPI output,
+ * whether or not FFTW_MPI_TRANSPOSED_OUT is used (local_0_start, local_n0 or local_1_start, local_n1).*/
+void kspace_layout_slab(_kspace_layout * layout, const int dims, const int slabstart, const int nslab);
+
+/** Multiply every mode of the local part of the grid by a function of k^2 = kx^2+ky^2+kz^2, in units of the fundamental mode.
+ * @param layout layout of the grid on this rank.
+ * @param field Fourier transformed grid.
+ * @param table table[k2] is the factor for a mode with k^2 = k2. Must have 3*(dims/2)^2+1 elements.*/
+void kspace_layout_multiply_k2(const _kspace_layout * layout, fftw_complex * field, const double table[]);
+
 /** Compute the total powerspectrum from a Fourier-transformed density field in outfield, and store it in power.
  * Before use you may wish to normalise by dividing by count^2 and 2*MPI/BoxSize. This assumes an FFTW2, slab decomposed, FFT.
  * Arguments:
@@ -29,4 +70,41 @@
  * @returns the number of bins in the output power spectrum, all of which have a non-zero number of modes.*/
 int total_powerspectrum(const int dims, fftw_complex *outfield, const int nrbins, const int startslab, const int nslab, double *power, long long int *count, double *keffs, const MPI_Comm MYMPI_COMM_WORLD);
 
+/** State of a power spectrum reduction which has been started but not finished.*/
+struct _powerspectrum_reduction {
+    /*Packed buffer of per-bin power, keffs and mode counts, then the total mass.*/
+    double * sums;
+    int nrbins;
+    MPI_Request request;
+};
+typedef struct _powerspectrum_reduction _powerspectrum_reduction;
+
+/** Split-phase version of total_powerspectrum, so that the caller can do other work while the sum over processors completes.
+ * This computes the power on this rank and starts a non-blocking sum over all ranks.
+ * Every rank must call total_powerspectrum_finish before the next collective operation on the communicator.
+ * Arguments are as for total_powerspectrum, except:
+ * @param layout layout of the grid on this rank, which need not be a slab.
+ * @param red Reduction state, filled in here and passed to total_powerspectrum_finish.
+ * The buffer in red is allocated with mymalloc, so memory allocated between start and finish should be freed before finish.*/
+void total_powerspectrum_start(const _kspace_layout * layout, fftw_complex *outfield, const int nrbins, _powerspectrum_reduction * red, const MPI_Comm MYMPI_COMM_WORLD);
+
+/** As total_powerspectrum_start, but also multiplies each mode by a function of k^2 in the same pass over the grid,
+ * as kspace_layout_multiply_k2 does. The power is computed from the field before it is multiplied.
+ * This halves the memory traffic when the factor does not depend on the power being computed, for example
+ * if it is from the previous step.
+ * @param table table[k2] is the factor for a mode with k^2 = k2. Must have 3*(dims/2)^2+1 elements. If NULL, the field is not changed.*/
+void total_powerspectrum_scale_start(const _kspace_layout * layout, fftw_complex *outfield, const int nrbins, const double * table, _powerspectrum_reduction * red, const MPI_Comm MYMPI_COMM_WORLD);
+
+/** Wait for the reduction started by total_powerspectrum_start to complete and fill the output arrays.
+ * The output arrays should have space for the nrbins given to total_powerspectrum_start.
+ * @param red Reduction state from total_powerspectrum_start.
+ * @param power, count, keffs As for total_powerspectrum.
+ * @returns the number of bins in the output power spectrum, all of which have a non-zero number of modes.*/
+int total_powerspectrum_finish(_powerspectrum_reduction * red, double *power, long long int *count, double *keffs);
+
+/** The bin of each mode, the window function and the mode counts depend only on the layout and the number of bins,
+ * so total_powerspectrum computes them once and stores them, until it is called with a different layout or number of bins.
+ * This frees that stored memory.*/
+void free_powerspectrum_cache(void);
+
 #endif
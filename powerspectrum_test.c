@@ -4,6 +4,8 @@
 #include <cmocka.h>
 #include <stdio.h>
 #include <math.h>
+#include <stdlib.h>
+#include <string.h>
 #include "powerspectrum.h"
 #ifdef NOTYPEPREFIX_FFTW
 #include        <rfftw.h>
@@ -46,6 +48,155 @@ static void test_total_powerspectrum(void **state) {
     rfftwnd_destroy_plan(pl);
 }
 
+/*CiC inverse window in one dimension*/
+static double ref_invwindow(int kx, int n)
+{
+    return kx ? M_PI*kx/(n*sin(M_PI*kx/(double)n)) : 1.0;
+}
+
+/*Check the binned power against a direct sum over every mode, on a larger grid*/
+static void test_total_powerspectrum_direct(void **state) {
+    (void) state;
+    const int dims = 16;
+    const int nrbins = 20;
+    const int nmodes = dims*dims*(dims/2+1);
+    double power[nrbins], keffs[nrbins], refpow[nrbins], refkeffs[nrbins];
+    long long int count[nrbins], refcount[nrbins];
+    fftw_complex * outfield = malloc(nmodes*sizeof(fftw_complex));
+    for(int i=0; i<nmodes; i++) {
+        outfield[i].re = sin(0.37*i+0.1);
+        outfield[i].im = cos(1.13*i);
+    }
+    const double mass2 = outfield[0].re*outfield[0].re + outfield[0].im*outfield[0].im;
+    const double binsperunit=(nrbins-1)/log(sqrt(3)*dims/2.0);
+    memset(refpow, 0, nrbins*sizeof(double));
+    memset(refkeffs, 0, nrbins*sizeof(double));
+    memset(refcount, 0, nrbins*sizeof(long long int));
+    for(int i=0; i<dims; i++)
+        for(int j=0; j<dims; j++)
+            for(int k=0; k<=dims/2; k++) {
+                const int kx = i <= dims/2 ? i : i - dims;
+                const int ky = j <= dims/2 ? j : j - dims;
+                if(kx == 0 && ky == 0 && k == 0)
+                    continue;
+                const int mult = (k == 0 || k == dims/2) ? 1 : 2;
+                const fftw_complex mode = outfield[(i*dims+j)*(dims/2+1)+k];
+                const double kk = sqrt(kx*kx+ky*ky+k*k);
+                const int psindex = floor(binsperunit*log(kk));
+                refpow[psindex] += mult*(mode.re*mode.re+mode.im*mode.im)*pow(ref_invwindow(kx,dims)*ref_invwindow(ky,dims)*ref_invwindow(k,dims),4);
+                refkeffs[psindex] += mult*kk;
+                refcount[psindex] += mult;
+            }
+    int nr_new = total_powerspectrum(dims, outfield, nrbins, 0, dims, power, count, keffs, MPI_COMM_WORLD);
+    int nonzero = 0;
+    for(int i=0; i<nrbins; i++) {
+        if(!refcount[i])
+            continue;
+        assert_true(count[nonzero] == refcount[i]);
+        assert_true(fabs(keffs[nonzero] - refkeffs[i]/refcount[i]) < 1e-12*keffs[nonzero]);
+        const double rpow = refpow[i]/refcount[i]/mass2;
+        assert_true(fabs(power[nonzero] - rpow) < 1e-5*rpow);
+        nonzero++;
+    }
+    assert_true(nr_new == nonzero);
+    /*The second call uses the stored bins, and should give the same answer*/
+    double power2[nrbins], keffs2[nrbins];
+    long long int count2[nrbins];
+    assert_true(total_powerspectrum(dims, outfield, nrbins, 0, dims, power2, count2, keffs2, MPI_COMM_WORLD) == nr_new);
+    for(int i=0; i<nr_new; i++) {
+        assert_true(count2[i] == count[i]);
+        assert_true(keffs2[i] == keffs[i]);
+        assert_true(power2[i] == power[i]);
+    }
+    free_powerspectrum_cache();
+    free(outfield);
+}
+
+/*Check that the power does not depend on how the grid is stored, and that the multiply kernel scales the right modes*/
+static void test_kspace_layout(void **state) {
+    (void) state;
+    const int dims = 16;
+    const int nrbins = 20;
+    const int nz = dims/2+1;
+    const int nmodes = dims*dims*nz;
+    double power[nrbins], keffs[nrbins], tpower[nrbins], tkeffs[nrbins];
+    long long int count[nrbins], tcount[nrbins];
+    fftw_complex * slab = malloc(nmodes*sizeof(fftw_complex));
+    fftw_complex * transposed = malloc(nmodes*sizeof(fftw_complex));
+    /*Store the same field as [x][y][z] and as [z][y][x]*/
+    for(int x=0; x<dims; x++)
+        for(int y=0; y<dims; y++)
+            for(int z=0; z<nz; z++) {
+                const int i = (x*dims+y)*nz+z;
+                slab[i].re = sin(0.37*i+0.1);
+                slab[i].im = cos(1.13*i);
+                transposed[(z*dims+y)*dims+x] = slab[i];
+            }
+    int nr_slab = total_powerspectrum(dims, slab, nrbins, 0, dims, power, count, keffs, MPI_COMM_WORLD);
+    _kspace_layout layout;
+    const int start[3] = {0,0,0};
+    const int nlocal[3] = {dims, dims, nz};
+    const ptrdiff_t stride[3] = {1, dims, dims*dims};
+    kspace_layout_init(&layout, dims, start, nlocal, stride);
+    _powerspectrum_reduction red;
+    total_powerspectrum_start(&layout, transposed, nrbins, &red, MPI_COMM_WORLD);
+    int nr_trans = total_powerspectrum_finish(&red, tpower, tcount, tkeffs);
+    assert_true(nr_slab == nr_trans);
+    for(int i=0; i<nr_slab; i++) {
+        assert_true(count[i] == tcount[i]);
+        assert_true(fabs(keffs[i] - tkeffs[i]) < 1e-12*keffs[i]);
+        assert_true(fabs(power[i] - tpower[i]) < 1e-12*power[i]);
+    }
+    /*Multiply a pencil of the slab grid by k^2+1*/
+    const int nk2 = 3*(dims/2)*(dims/2)+1;
+    double table[nk2];
+    for(int k2=0; k2<nk2; k2++)
+        table[k2] = k2+1;
+    const int start0 = 3, n0 = 5, start1 = 10, n1 = 6;
+    fftw_complex * pencil = malloc(n0*n1*nz*sizeof(fftw_complex));
+    for(int x=0; x<n0; x++)
+        for(int y=0; y<n1; y++)
+            for(int z=0; z<nz; z++)
+                pencil[(x*n1+y)*nz+z] = slab[((x+start0)*dims+y+start1)*nz+z];
+    kspace_layout_pencil(&layout, dims, start0, n0, start1, n1);
+    kspace_layout_multiply_k2(&layout, pencil, table);
+    for(int x=0; x<n0; x++)
+        for(int y=0; y<n1; y++)
+            for(int z=0; z<nz; z++) {
+                const int kx = x+start0 <= dims/2 ? x+start0 : x+start0-dims;
+                const int ky = y+start1 <= dims/2 ? y+start1 : y+start1-dims;
+                const fftw_complex orig = slab[((x+start0)*dims+y+start1)*nz+z];
+                const fftw_complex mult = pencil[(x*n1+y)*nz+z];
+                const double fac = kx*kx+ky*ky+z*z+1;
+                assert_true(fabs(mult.re - fac*orig.re) <= 1e-6*fabs(fac*orig.re));
+                assert_true(fabs(mult.im - fac*orig.im) <= 1e-6*fabs(fac*orig.im));
+            }
+    /*Binning and multiplying in one pass should give the power before the multiply, and the multiplied field*/
+    kspace_layout_init(&layout, dims, start, nlocal, stride);
+    total_powerspectrum_scale_start(&layout, transposed, nrbins, table, &red, MPI_COMM_WORLD);
+    nr_trans = total_powerspectrum_finish(&red, tpower, tcount, tkeffs);
+    assert_true(nr_slab == nr_trans);
+    for(int i=0; i<nr_slab; i++) {
+        assert_true(count[i] == tcount[i]);
+        assert_true(fabs(power[i] - tpower[i]) < 1e-12*power[i]);
+    }
+    for(int x=0; x<dims; x++)
+        for(int y=0; y<dims; y++)
+            for(int z=0; z<nz; z++) {
+                const int kx = x <= dims/2 ? x : x-dims;
+                const int ky = y <= dims/2 ? y : y-dims;
+                const fftw_complex orig = slab[(x*dims+y)*nz+z];
+                const fftw_complex mult = transposed[(z*dims+y)*dims+x];
+                const double fac = kx*kx+ky*ky+z*z+1;
+                assert_true(fabs(mult.re - fac*orig.re) <= 1e-6*fabs(fac*orig.re));
+                assert_true(fabs(mult.im - fac*orig.im) <= 1e-6*fabs(fac*orig.im));
+            }
+    free_powerspectrum_cache();
+    free(pencil);
+    free(transposed);
+    free(slab);
+}
+
 static int setup_mpi(void **state) {
     int ac=1;
     char * str = "powerspectrum_test";
@@ -64,6 +215,8 @@ int main(void)
 {
     const struct CMUnitTest tests[] = {
         cmocka_unit_test(test_total_powerspectrum),
+        cmocka_unit_test(test_total_powerspectrum_direct),
+        cmocka_unit_test(test_kspace_layout),
     };
     return cmocka_run_group_tests(tests, setup_mpi, teardown_mpi);
 }
@@ -0,0 +1,38 @@
+#ifndef UNIFORM_INTERP_H
+#define UNIFORM_INTERP_H
+/**\file
+ * Cubic Hermite interpolation on a uniform grid, given the values and derivatives at each grid point.
+ * Unlike a GSL spline this needs no search and no accelerator, so it is O(1) and
+ * safe to call from several threads at once.
+ * Each interval depends only on the points at its ends, so a table may be extended
+ * without changing the interpolation in the part already computed.
+ */
+
+/** Evaluate the cubic Hermite interpolant at x.
+ * @param y Values at the grid points x0 + i*dx.
+ * @param dydx Derivatives dy/dx at the grid points.
+ * @param n Number of grid points. Must be at least 2.
+ * @param x0 First grid point.
+ * @param dx Grid spacing.
+ * @param x Point to evaluate at. Points outside the grid are extrapolated from the nearest interval.
+ * @returns interpolated value of y(x).*/
+static inline double uniform_hermite_eval(const double y[], const double dydx[], const int n, const double x0, const double dx, const double x)
+{
+    const double u = (x - x0)/dx;
+    int i = (int) u;
+    if(u < 0)
+        i = 0;
+    if(i > n-2)
+        i = n-2;
+    const double t = u - i;
+    const double t2 = t*t;
+    const double t3 = t2*t;
+    /*Hermite basis functions*/
+    const double h00 = 2*t3 - 3*t2 + 1;
+    const double h10 = t3 - 2*t2 + t;
+    const double h01 = -2*t3 + 3*t2;
+    const double h11 = t3 - t2;
+    return h00*y[i] + h01*y[i+1] + dx*(h10*dydx[i] + h11*dydx[i+1]);
+}
+
+#endif